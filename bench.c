@@ -0,0 +1,1001 @@
+#define NOB_IMPLEMENTATION
+#include "nob.h"
+
+#define GRAPHICS_IMPLEMENTATION
+#include "graphics.h"
+
+#define SCENES_IMPLEMENTATION
+#include "scenes.h"
+
+#include <time.h>
+#include <sys/resource.h>
+
+#define KERNEL_RAYS 4096
+#define BVH_SPHERES 100000
+#define BVH_WIDTH 800
+#define BVH_HEIGHT 600
+#define BVH_LINEAR_STRIDE 97
+#define PACKET_WIDTH 800
+#define PACKET_HEIGHT 600
+#define AA_WIDTH 800
+#define AA_HEIGHT 600
+#define AA_SAMPLES 4
+#define AA_THRESHOLD 0.05f
+#define SHADOW_WIDTH 400
+#define SHADOW_HEIGHT 300
+#define PPM_WIDTH 3840
+#define PPM_HEIGHT 2160
+#define PPM_PATH "bench.ppm"
+#define TONEMAP_WIDTH 3840
+#define TONEMAP_HEIGHT 2160
+#define SCENE_FILE_SPHERES 1000000
+#define SCENE_FILE_PATH "bench.scene"
+#define STARTUP_SPHERES 1000000
+#define STARTUP_BINARY_PATH "bench.bscene"
+#define STARTUP_WIDTH 400
+#define STARTUP_HEIGHT 300
+#define REPROJECT_WIDTH 800
+#define REPROJECT_HEIGHT 600
+#define REPROJECT_FRAMES 30
+#define LIGHTING_WIDTH 400
+#define LIGHTING_HEIGHT 300
+#define LIGHTING_RUNS 5
+#define SUITE_WIDTH 800
+#define SUITE_HEIGHT 600
+#define SUITE_RUNS 10
+#define RANDOM_SEED 1
+
+static volatile size_t bench_sink;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static float random_float(float lo, float hi) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return lo + (hi - lo)*(float)(rng_state >> 40)/(float)(1ull << 24);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Checks a kernel against the scalar one and returns the worst relative t error
+static bool kernel_validate(IntersectSpheresFn kernel, const SceneSpheres *spheres, Vector3 *directions, size_t ray_count, float *max_error) {
+    IntersectSpheresFn scalar = sphere_kernel_fn(SPHERE_KERNEL_SCALAR);
+    Vector3 origin = {0};
+    *max_error = 0;
+    for (size_t r = 0; r < ray_count; r++) {
+        float expected_t = T_MAX, actual_t = T_MAX;
+        size_t expected = scalar(spheres, 0, spheres->count, origin, directions[r], 1, &expected_t);
+        size_t actual = kernel(spheres, 0, spheres->count, origin, directions[r], 1, &actual_t);
+        if ((expected == SPHERE_NONE) != (actual == SPHERE_NONE)) return false;
+        if (expected == SPHERE_NONE) continue;
+
+        float error = fabsf(actual_t - expected_t)/fmaxf(1, fabsf(expected_t));
+        if (error > *max_error) *max_error = error;
+        if (error > SPHERE_KERNEL_EPSILON) return false;
+        if (expected != actual) {
+            // Allowed only when the two hits are indistinguishable along the ray
+            float other_t = T_MAX;
+            scalar(spheres, actual, actual + 1, origin, directions[r], 1, &other_t);
+            if (fabsf(other_t - expected_t)/fmaxf(1, fabsf(expected_t)) > SPHERE_KERNEL_EPSILON) return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_sphere_kernels(void) {
+    bool ok = true;
+    size_t sphere_counts[] = {8, 64, 1024, 16384};
+
+    Vector3 *directions = malloc(KERNEL_RAYS*sizeof(*directions));
+    assert(directions != NULL && "Buy more RAM lol");
+    for (size_t r = 0; r < KERNEL_RAYS; r++) {
+        directions[r] = (Vector3){random_float(-0.5, 0.5), random_float(-0.5, 0.5), 1};
+    }
+
+    printf("%-8s %8s %8s %16s %14s\n", "kernel", "spheres", "rays", "Mray*spheres/s", "max_rel_err");
+    for (size_t s = 0; s < NOB_ARRAY_LEN(sphere_counts); s++) {
+        Scene scene = {0};
+        scene_random(&scene, sphere_counts[s], RANDOM_SEED);
+        CompiledScene compiled = compile_scene(&scene);
+        SceneSpheres *spheres = &compiled.spheres;
+
+        for (SphereKernel k = SPHERE_KERNEL_SCALAR; k < SPHERE_KERNEL_COUNT; k++) {
+            if (!sphere_kernel_supported(k)) continue;
+            IntersectSpheresFn kernel = sphere_kernel_fn(k);
+
+            float max_error = 0;
+            if (!kernel_validate(kernel, spheres, directions, KERNEL_RAYS, &max_error)) {
+                fprintf(stderr, "ERROR: %s kernel disagrees with scalar beyond SPHERE_KERNEL_EPSILON on %zu spheres\n", sphere_kernel_name(k), spheres->count);
+                ok = false;
+            }
+
+            // Repeat until the measurement is long enough to trust
+            size_t rays = 0;
+            size_t hits = 0;
+            double start = now_seconds();
+            double elapsed = 0;
+            do {
+                for (size_t r = 0; r < KERNEL_RAYS; r++) {
+                    float t = T_MAX;
+                    hits += kernel(spheres, 0, spheres->count, (Vector3){0}, directions[r], 1, &t) != SPHERE_NONE;
+                }
+                rays += KERNEL_RAYS;
+                elapsed = now_seconds() - start;
+            } while (elapsed < 0.25);
+            bench_sink += hits;
+
+            printf("%-8s %8zu %8zu %16.1f %14.3g\n", sphere_kernel_name(k), spheres->count, rays,
+                   (double)rays*spheres->count/elapsed/1e6, max_error);
+        }
+
+        free_compiled_scene(&compiled);
+        nob_da_free(scene);
+    }
+
+    free(directions);
+    return ok;
+}
+
+static bool bench_bvh(void) {
+    bool ok = true;
+    Scene scene = {0};
+    scene_random(&scene, BVH_SPHERES, RANDOM_SEED);
+    CompiledScene compiled = compile_scene(&scene);
+    Bvh *bvh = &compiled.bvh;
+    SceneSpheres *spheres = &compiled.spheres;
+    assert(bvh->count > 0);
+
+    printf("bvh: %zu spheres, %zu nodes, %zu leaves (%.2f spheres/leaf), depth %zu, built in %.1f ms\n",
+           spheres->count, bvh->count, bvh->leaf_count, (double)spheres->count/bvh->leaf_count,
+           bvh->max_depth, bvh->build_seconds*1e3);
+
+    Canvas canvas = { .width = BVH_WIDTH, .height = BVH_HEIGHT };
+    BvhTraversalStats stats = {0};
+    double start = now_seconds();
+    for (int y = -canvas.height/2; y < canvas.height/2; y++) {
+        for (int x = -canvas.width/2; x < canvas.width/2; x++) {
+            Vector3 direction = canvas_to_viewport(&canvas, 1, 1, 1, x, y);
+            float t = T_MAX;
+            bvh_intersect(bvh, spheres, (Vector3){0}, direction, 1, &t, &stats);
+        }
+    }
+    double bvh_elapsed = now_seconds() - start;
+
+    // The linear scan is far too slow for a full frame, so sample every Nth ray
+    size_t linear_rays = 0;
+    double linear_elapsed = 0;
+    for (size_t i = 0; i < (size_t)BVH_WIDTH*BVH_HEIGHT; i += BVH_LINEAR_STRIDE) {
+        int x = (int)(i%BVH_WIDTH) - BVH_WIDTH/2;
+        int y = (int)(i/BVH_WIDTH) - BVH_HEIGHT/2;
+        Vector3 direction = canvas_to_viewport(&canvas, 1, 1, 1, x, y);
+        float linear_t = T_MAX, bvh_t = T_MAX;
+        start = now_seconds();
+        size_t linear = intersect_spheres(spheres, 0, spheres->count, (Vector3){0}, direction, 1, &linear_t);
+        linear_elapsed += now_seconds() - start;
+        linear_rays += 1;
+        size_t hit = bvh_intersect(bvh, spheres, (Vector3){0}, direction, 1, &bvh_t, NULL);
+        if (hit != linear || bvh_t != linear_t) {
+            fprintf(stderr, "ERROR: bvh and linear scan disagree on ray (%d, %d)\n", x, y);
+            ok = false;
+        }
+    }
+
+    printf("bvh: %.2f Mrays/s, %.1f nodes visited/ray, %.2f leaves/ray, %.1f sphere tests/ray\n",
+           stats.rays/bvh_elapsed/1e6, (double)stats.nodes_visited/stats.rays,
+           (double)stats.leaves_visited/stats.rays, (double)stats.sphere_tests/stats.rays);
+    printf("linear: %.4f Mrays/s (%zu sampled rays)\n", linear_rays/linear_elapsed/1e6, linear_rays);
+
+    free_compiled_scene(&compiled);
+    nob_da_free(scene);
+    return ok;
+}
+
+static void render_per_ray(Canvas *canvas, CompiledScene *scene) {
+    for (int y = -canvas->height/2; y < canvas->height/2; y++) {
+        for (int x = -canvas->width/2; x < canvas->width/2; x++) {
+            Vector3 direction = canvas_to_viewport(canvas, 1, 1, 1, x, y);
+            RayBudget budget = ray_budget_pixel(scene, x, y, 0);
+            PutRadiance(canvas, x, y, trace_ray(scene, (Vector3){0}, direction, 1, T_MAX, &budget), 1);
+        }
+    }
+}
+
+static void render_packets(Canvas *canvas, CompiledScene *scene, int size, PacketStats *stats) {
+    for (int y = -canvas->height/2; y < canvas->height/2; y += size) {
+        for (int x = -canvas->width/2; x < canvas->width/2; x += size) {
+            Tile block = {
+                .x0 = x, .y0 = y,
+                .x1 = x + size < canvas->width/2 ? x + size : canvas->width/2,
+                .y1 = y + size < canvas->height/2 ? y + size : canvas->height/2,
+            };
+            trace_packet(canvas, scene, (Vector3){0}, (Vector2){1, 1}, 1, block, stats);
+        }
+    }
+}
+
+// Primary rays per second for one way of rendering a frame, repeated until
+// the measurement is long enough
+#define measure_frames(mrays, canvas, ...)                              \
+    do {                                                                \
+        size_t frames = 0;                                              \
+        double start = now_seconds(), elapsed = 0;                      \
+        do {                                                            \
+            __VA_ARGS__;                                                \
+            frames += 1;                                                \
+            elapsed = now_seconds() - start;                            \
+        } while (elapsed < 0.25);                                       \
+        (mrays) = (double)frames*(canvas).width*(canvas).height/elapsed/1e6; \
+    } while (0)
+
+static bool bench_packets_on(const char *name, Scene *scene) {
+    bool ok = true;
+    CompiledScene compiled = compile_scene(scene);
+    size_t pixels = (size_t)PACKET_WIDTH*PACKET_HEIGHT;
+    Canvas expected = canvas_alloc(PACKET_WIDTH, PACKET_HEIGHT);
+    Canvas actual = canvas_alloc(PACKET_WIDTH, PACKET_HEIGHT);
+
+    double per_ray = 0;
+    measure_frames(per_ray, expected, render_per_ray(&expected, &compiled));
+
+    int sizes[] = {4, 8};
+    for (size_t i = 0; i < NOB_ARRAY_LEN(sizes); i++) {
+        PacketStats stats = {0};
+        render_packets(&actual, &compiled, sizes[i], &stats);
+        // The BVH walks leaves in a different order than packets do, so only
+        // exact t ties could legitimately disagree; flat scenes must match bit for bit
+        size_t mismatches = 0;
+        for (size_t p = 0; p < pixels; p++) {
+            mismatches += memcmp(&expected.radiance[4*p], &actual.radiance[4*p], 4*sizeof(float)) != 0;
+        }
+        if (mismatches > 0 && compiled.bvh.count == 0) {
+            fprintf(stderr, "ERROR: %dx%d packets differ from trace_ray on %zu pixels of %s\n", sizes[i], sizes[i], mismatches, name);
+            ok = false;
+        }
+
+        double packets = 0;
+        measure_frames(packets, actual, render_packets(&actual, &compiled, sizes[i], NULL));
+        printf("packets %-10s %dx%d: %7.2f Mrays/s vs %7.2f per ray (%.2fx), %.1f%% culled, %.1f%% diverged, %zu pixels differ\n",
+               name, sizes[i], sizes[i], packets, per_ray, packets/per_ray,
+               100.0*stats.culled/stats.packets, 100.0*stats.diverged/stats.packets, mismatches);
+    }
+
+    canvas_free(&actual);
+    canvas_free(&expected);
+    free_compiled_scene(&compiled);
+    return ok;
+}
+
+static bool bench_packets(void) {
+    bool ok = true;
+
+    Scene demo = {0};
+    scene_demo(&demo);
+    if (!bench_packets_on("demo", &demo)) ok = false;
+    nob_da_free(demo);
+
+    Scene mirrors = {0};
+    scene_mirrors(&mirrors);
+    if (!bench_packets_on("mirrors", &mirrors)) ok = false;
+    nob_da_free(mirrors);
+
+    Scene random = {0};
+    scene_random(&random, BVH_SPHERES, RANDOM_SEED);
+    if (!bench_packets_on("random100k", &random)) ok = false;
+    nob_da_free(random);
+
+    return ok;
+}
+
+// The writer canvas_to_ppm_file replaced, kept as the baseline
+static void ppm_write_fputc(Canvas *canvas, const char *filepath) {
+    FILE *f = fopen(filepath, "w");
+    assert(f != NULL);
+    fprintf(f, "P6\n%d %d\n255\n", canvas->width, canvas->height);
+    for (size_t i = 0; i < (size_t)canvas->width*canvas->height; i++) {
+        uint32_t c = canvas->pixels[i];
+        fputc(color_r(c), f);
+        fputc(color_g(c), f);
+        fputc(color_b(c), f);
+    }
+    fclose(f);
+}
+
+// Feeds the stream tile by tile in pool order, which is bottom up, so rows
+// are held back until the top band arrives; the worst case for the stream
+static bool ppm_write_stream(Canvas *canvas, const char *filepath) {
+    PpmStream stream;
+    if (!ppm_stream_open(&stream, filepath, canvas->width, canvas->height)) return false;
+    for (int y = -canvas->height/2; y < canvas->height/2; y += RENDER_TILE_SIZE) {
+        for (int x = -canvas->width/2; x < canvas->width/2; x += RENDER_TILE_SIZE) {
+            Tile tile = {
+                .x0 = x, .y0 = y,
+                .x1 = x + RENDER_TILE_SIZE < canvas->width/2 ? x + RENDER_TILE_SIZE : canvas->width/2,
+                .y1 = y + RENDER_TILE_SIZE < canvas->height/2 ? y + RENDER_TILE_SIZE : canvas->height/2,
+            };
+            ppm_stream_tile_done(&stream, canvas, tile);
+        }
+    }
+    return ppm_stream_close(&stream);
+}
+
+#define measure_writes(mbytes, bytes, ...)                              \
+    do {                                                                \
+        size_t writes = 0;                                              \
+        double start = now_seconds(), elapsed = 0;                      \
+        do {                                                            \
+            __VA_ARGS__;                                                \
+            writes += 1;                                                \
+            elapsed = now_seconds() - start;                            \
+        } while (elapsed < 0.5);                                        \
+        (mbytes) = (double)writes*(bytes)/elapsed/1e6;                  \
+    } while (0)
+
+static bool bench_ppm(void) {
+    bool ok = true;
+    size_t count = (size_t)PPM_WIDTH*PPM_HEIGHT;
+    Canvas canvas = { .pixels = malloc(count*sizeof(uint32_t)), .width = PPM_WIDTH, .height = PPM_HEIGHT };
+    uint8_t *rgb = malloc(3*count);
+    assert(canvas.pixels != NULL && rgb != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < count; i++) {
+        canvas.pixels[i] = to_c((uint32_t)random_float(0, 256), (uint32_t)random_float(0, 256), (uint32_t)random_float(0, 256));
+    }
+
+    Nob_String_Builder expected = {0};
+    Nob_String_Builder actual = {0};
+    ppm_write_fputc(&canvas, PPM_PATH);
+    ok = ok && nob_read_entire_file(PPM_PATH, &expected);
+    ok = ok && canvas_to_ppm_file(&canvas, PPM_PATH) && nob_read_entire_file(PPM_PATH, &actual);
+    if (ok && (actual.count != expected.count || memcmp(actual.items, expected.items, actual.count) != 0)) {
+        fprintf(stderr, "ERROR: canvas_to_ppm_file output differs from the fputc writer\n");
+        ok = false;
+    }
+    actual.count = 0;
+    ok = ok && ppm_write_stream(&canvas, PPM_PATH) && nob_read_entire_file(PPM_PATH, &actual);
+    if (ok && (actual.count != expected.count || memcmp(actual.items, expected.items, actual.count) != 0)) {
+        fprintf(stderr, "ERROR: PpmStream output differs from the fputc writer\n");
+        ok = false;
+    }
+
+    size_t bytes = expected.count;
+    double fputc_rate = 0, file_rate = 0, stream_rate = 0, pack_rate = 0;
+    measure_writes(fputc_rate, bytes, ppm_write_fputc(&canvas, PPM_PATH));
+    measure_writes(file_rate, bytes, canvas_to_ppm_file(&canvas, PPM_PATH));
+    measure_writes(stream_rate, bytes, ppm_write_stream(&canvas, PPM_PATH));
+    measure_writes(pack_rate, 3*count, canvas_pack_rgb(canvas.pixels, count, rgb); bench_sink = rgb[count]);
+    printf("ppm %dx%d: fputc %7.1f MB/s, canvas_to_ppm_file %7.1f MB/s (%.1fx), stream %7.1f MB/s, pack only %7.1f MB/s\n",
+           PPM_WIDTH, PPM_HEIGHT, fputc_rate, file_rate, file_rate/fputc_rate, stream_rate, pack_rate);
+
+    remove(PPM_PATH);
+    nob_sb_free(actual);
+    nob_sb_free(expected);
+    free(rgb);
+    free(canvas.pixels);
+    return ok;
+}
+
+typedef struct {
+    Vector3 origin;
+    Vector3 direction;
+    float t_max;
+} ShadowQuery;
+
+typedef struct {
+    ShadowQuery *items;
+    size_t count;
+    size_t capacity;
+} ShadowQueries;
+
+// The closest-hit query trace_ray runs, used as the baseline for shadow rays
+static bool shadow_closest_hit(CompiledScene *scene, ShadowQuery q) {
+    float t = q.t_max;
+    size_t hit = scene->bvh.count > 0
+        ? bvh_intersect(&scene->bvh, &scene->spheres, q.origin, q.direction, RAY_EPSILON, &t, NULL)
+        : intersect_spheres(&scene->spheres, 0, scene->spheres.count, q.origin, q.direction, RAY_EPSILON, &t);
+    return hit != SPHERE_NONE;
+}
+
+// Shadow rays exactly as compute_lighting casts them from the primary hits
+static void shadow_queries_collect(CompiledScene *scene, ShadowQueries *queries) {
+    Canvas canvas = { .width = SHADOW_WIDTH, .height = SHADOW_HEIGHT };
+    SceneSpheres *spheres = &scene->spheres;
+    for (int y = -canvas.height/2; y < canvas.height/2; y++) {
+        for (int x = -canvas.width/2; x < canvas.width/2; x++) {
+            Vector3 direction = canvas_to_viewport(&canvas, 1, 1, 1, x, y);
+            float t = T_MAX;
+            size_t hit = scene->bvh.count > 0
+                ? bvh_intersect(&scene->bvh, spheres, (Vector3){0}, direction, 1, &t, NULL)
+                : intersect_spheres(spheres, 0, spheres->count, (Vector3){0}, direction, 1, &t);
+            if (hit == SPHERE_NONE) continue;
+
+            Vector3 P = Vector3Scale(direction, t);
+            Vector3 N = Vector3Normalize(Vector3Subtract(P, (Vector3){spheres->cx[hit], spheres->cy[hit], spheres->cz[hit]}));
+            Vector3 origin = Vector3Add(P, Vector3Scale(N, RAY_EPSILON));
+            for (size_t i = 0; i < scene->lights.count; i++) {
+                Light light = scene->lights.items[i];
+                if (light.type == LIGHT_TYPE_AMBIENT) continue;
+                ShadowQuery q = { .origin = origin, .direction = light.direction, .t_max = T_MAX };
+                if (light.type == LIGHT_TYPE_POINT) {
+                    q.direction = Vector3Subtract(light.position, P);
+                    q.t_max = 1;
+                }
+                if (Vector3DotProduct(N, q.direction) > 0) nob_da_append(queries, q);
+            }
+        }
+    }
+}
+
+static bool bench_shadows(void) {
+    bool ok = true;
+    const char *names[] = {"demo", "lights64", "random10k", "random100k"};
+    for (size_t s = 0; s < sizeof(names)/sizeof(names[0]); s++) {
+        Scene scene = {0};
+        if (!scene_by_name(&scene, names[s])) return false;
+        CompiledScene compiled = compile_scene(&scene);
+        ShadowQueries queries = {0};
+        shadow_queries_collect(&compiled, &queries);
+
+        size_t occluded = 0, mismatches = 0;
+        for (size_t i = 0; i < queries.count; i++) {
+            ShadowQuery q = queries.items[i];
+            bool any = scene_occluded(&compiled, q.origin, q.direction, RAY_EPSILON, q.t_max);
+            occluded += any;
+            mismatches += any != shadow_closest_hit(&compiled, q);
+        }
+        if (mismatches > 0) {
+            fprintf(stderr, "ERROR: any-hit and closest-hit disagree on %zu shadow rays in %s\n", mismatches, names[s]);
+            ok = false;
+        }
+
+        double closest_rate = 0, any_rate = 0;
+        measure_writes(closest_rate, queries.count,
+            for (size_t i = 0; i < queries.count; i++) bench_sink += shadow_closest_hit(&compiled, queries.items[i]));
+        measure_writes(any_rate, queries.count,
+            for (size_t i = 0; i < queries.count; i++) {
+                ShadowQuery q = queries.items[i];
+                bench_sink += scene_occluded(&compiled, q.origin, q.direction, RAY_EPSILON, q.t_max);
+            });
+        printf("shadows %-10s: %7zu rays, %5.1f%% occluded, closest hit %7.2f Mrays/s, any hit %7.2f Mrays/s (%.2fx)\n",
+               names[s], queries.count, queries.count ? 100.0*occluded/queries.count : 0,
+               closest_rate, any_rate, any_rate/closest_rate);
+
+        nob_da_free(queries);
+        free_compiled_scene(&compiled);
+        nob_da_free(scene);
+    }
+    return ok;
+}
+
+// Frame time as the light count grows. Past a few lights shading dominates,
+// so the time per light and pixel is what the lighting loop costs.
+static bool bench_lighting(void) {
+    const char *names[] = {"demo", "lights64", "lights256", "lights512"};
+    RenderPool *pool = render_pool_create(0, RENDER_TILE_SIZE);
+    if (pool == NULL) return false;
+    Canvas canvas = canvas_alloc(LIGHTING_WIDTH, LIGHTING_HEIGHT);
+    RenderView view = { .camera = {0}, .v = {1, 1}, .distance = 1 };
+    for (size_t s = 0; s < NOB_ARRAY_LEN(names); s++) {
+        Scene scene = {0};
+        if (!scene_by_name(&scene, names[s])) return false;
+        CompiledScene compiled = compile_scene(&scene);
+        render_scene_pass(pool, &canvas, &compiled, view, 1, 0, NULL);
+
+        double start = now_seconds();
+        for (int i = 0; i < LIGHTING_RUNS; i++) render_scene_pass(pool, &canvas, &compiled, view, 1, 0, NULL);
+        double frame = (now_seconds() - start)/LIGHTING_RUNS;
+        printf("lighting %-10s: %4zu lights, %8.2f ms per frame, %6.2f ns per light and pixel\n",
+               names[s], compiled.lights.count, frame*1e3,
+               frame*1e9/((double)LIGHTING_WIDTH*LIGHTING_HEIGHT*compiled.lights.count));
+
+        free_compiled_scene(&compiled);
+        nob_da_free(scene);
+    }
+    canvas_free(&canvas);
+    render_pool_destroy(pool);
+    return true;
+}
+
+// Frame time and rays per pixel of each sampling mode, with the error of the
+// cheaper ones against the full grid
+static bool bench_antialiasing(void) {
+    const char *names[] = {"demo", "mirrors", "random1k"};
+    SampleSettings modes[] = {
+        { .samples = AA_SAMPLES, .pattern = SAMPLE_GRID },
+        { .samples = AA_SAMPLES, .pattern = SAMPLE_JITTER },
+        { .samples = AA_SAMPLES, .pattern = SAMPLE_GRID, .adaptive = AA_THRESHOLD },
+        { .samples = AA_SAMPLES, .pattern = SAMPLE_JITTER, .adaptive = AA_THRESHOLD },
+    };
+    RenderPool *pool = render_pool_create(0, RENDER_TILE_SIZE);
+    if (pool == NULL) return false;
+    Canvas reference = canvas_alloc(AA_WIDTH, AA_HEIGHT);
+    Canvas canvas = canvas_alloc(AA_WIDTH, AA_HEIGHT);
+    RenderView view = { .camera = {0}, .v = {1, 1}, .distance = 1 };
+
+    for (size_t s = 0; s < sizeof(names)/sizeof(names[0]); s++) {
+        Scene scene = {0};
+        if (!scene_by_name(&scene, names[s])) return false;
+        CompiledScene compiled = compile_scene(&scene);
+        render_scene_sampled(pool, &reference, &compiled, view, modes[0], NULL);
+
+        for (size_t m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+            SampleHistogram histogram;
+            double start = now_seconds();
+            render_scene_sampled(pool, &canvas, &compiled, view, modes[m], &histogram);
+            double elapsed = now_seconds() - start;
+            CanvasDiff diff = canvas_diff(&reference, &canvas, NULL);
+            uint64_t pixels = (uint64_t)AA_WIDTH*AA_HEIGHT;
+            printf("aa %-8s %dx%d %-6s %-8s: %8.2f ms, %5.2f rays/pixel, %5.1f%% refined, PSNR vs grid %6.2f dB\n",
+                   names[s], AA_SAMPLES, AA_SAMPLES, modes[m].pattern == SAMPLE_JITTER ? "jitter" : "grid",
+                   modes[m].adaptive > 0 ? "adaptive" : "full", elapsed*1e3, (double)histogram.samples/pixels,
+                   100.0*histogram.pixels[AA_SAMPLES*AA_SAMPLES]/pixels, diff.psnr);
+        }
+
+        free_compiled_scene(&compiled);
+        nob_da_free(scene);
+    }
+
+    canvas_free(&canvas);
+    canvas_free(&reference);
+    render_pool_destroy(pool);
+    return true;
+}
+
+// One resolve of the whole frame on this thread and through the pool, checked
+// against the scalar reference within one 8-bit step
+static bool bench_tonemap(void) {
+    bool ok = true;
+    Canvas canvas = canvas_alloc(TONEMAP_WIDTH, TONEMAP_HEIGHT);
+    size_t count = (size_t)TONEMAP_WIDTH*TONEMAP_HEIGHT;
+    uint32_t *expected = malloc(count*sizeof(uint32_t));
+    assert(expected != NULL && "Buy more RAM lol");
+    // HDR values well past 1 so every curve has something to compress
+    for (size_t i = 0; i < count; i++) {
+        float w = random_float(0, 1) < 0.01f ? 0 : 4;
+        for (int c = 0; c < 3; c++) canvas.radiance[4*i + c] = w*random_float(0, 4);
+        canvas.radiance[4*i + 3] = w;
+    }
+    RenderPool *pool = render_pool_create(0, RENDER_TILE_SIZE);
+    if (pool == NULL) {
+        canvas_free(&canvas);
+        free(expected);
+        return false;
+    }
+    Tile frame = {
+        .x0 = -TONEMAP_WIDTH/2, .y0 = -TONEMAP_HEIGHT/2,
+        .x1 = TONEMAP_WIDTH/2, .y1 = TONEMAP_HEIGHT/2,
+    };
+
+    double quantize_rate = 0;
+    measure_writes(quantize_rate, count, canvas_quantize(&canvas, frame));
+    printf("tonemap %dx%d: quantize only %7.1f Mpixels/s\n", TONEMAP_WIDTH, TONEMAP_HEIGHT, quantize_rate);
+
+    for (int curve = 0; curve < TONE_CURVE_COUNT; curve++) {
+        for (int srgb = 0; srgb <= 1; srgb++) {
+            ToneMap tone = { .exposure = -1, .curve = (ToneCurve)curve, .srgb = srgb };
+            pthread_once(&srgb_lut_once, srgb_lut_init);
+            float scale = exp2f(tone.exposure);
+            for (size_t i = 0; i < count; i++) expected[i] = tone_map_pixel(&canvas.radiance[4*i], scale, tone);
+
+            canvas_resolve(pool, &canvas, tone);
+            Canvas reference = { .pixels = expected, .width = TONEMAP_WIDTH, .height = TONEMAP_HEIGHT };
+            int max_error = canvas_diff(&reference, &canvas, NULL).max_error;
+            if (max_error > 1) {
+                fprintf(stderr, "ERROR: canvas_resolve %s differs from the scalar reference by %d\n", tone_curve_name(tone.curve), max_error);
+                ok = false;
+            }
+
+            double scalar_rate = 0, row_rate = 0, pool_rate = 0;
+            measure_writes(scalar_rate, count,
+                for (size_t i = 0; i < count; i++) canvas.pixels[i] = tone_map_pixel(&canvas.radiance[4*i], scale, tone));
+            measure_writes(row_rate, count, canvas_resolve(NULL, &canvas, tone));
+            measure_writes(pool_rate, count, canvas_resolve(pool, &canvas, tone));
+            printf("tonemap %-8s %-6s: scalar %7.1f, simd %7.1f (%.1fx), pool %7.1f Mpixels/s, max error %d\n",
+                   tone_curve_name(tone.curve), srgb ? "srgb" : "linear", scalar_rate, row_rate, row_rate/scalar_rate, pool_rate, max_error);
+        }
+    }
+
+    render_pool_destroy(pool);
+    free(expected);
+    canvas_free(&canvas);
+    return ok;
+}
+
+// Writes random1M as text and loads it back, which must give the same scene
+static bool bench_scene_file(void) {
+    Scene scene = {0};
+    scene_random(&scene, SCENE_FILE_SPHERES, RANDOM_SEED);
+    RenderView view = { .camera = {0, 0, 0}, .v = {1, 1}, .distance = 1 };
+    double start = now_seconds();
+    if (!scene_save_file(&scene, &view, SCENE_FILE_PATH)) return false;
+    double save_ms = (now_seconds() - start)*1e3;
+
+    Nob_String_Builder source = {0};
+    if (!nob_read_entire_file(SCENE_FILE_PATH, &source)) return false;
+    Scene loaded = {0};
+    RenderView loaded_view = {0};
+    bool ok = scene_parse(&loaded, &loaded_view, SCENE_FILE_PATH, nob_sb_to_sv(source));
+    ok = ok && loaded.count == scene.count && memcmp(&loaded_view, &view, sizeof(view)) == 0;
+    for (size_t i = 0; ok && i < scene.count; i++) {
+        SceneObject *a = &scene.items[i], *b = &loaded.items[i];
+        ok = a->type == b->type && (a->type == SCENE_OBJECT_SPHERE
+            ? memcmp(&a->obj.sphere, &b->obj.sphere, sizeof(Sphere)) == 0
+            : a->obj.light.type == b->obj.light.type && a->obj.light.intensity == b->obj.light.intensity
+              && memcmp(&a->obj.light.position, &b->obj.light.position, sizeof(Vector3)) == 0);
+        if (!ok) fprintf(stderr, "ERROR: Object %zu of %s does not match the saved scene\n", i, SCENE_FILE_PATH);
+    }
+
+    double parse_ms = INFINITY, load_ms = INFINITY;
+    for (int run = 0; ok && run < 3; run++) {
+        loaded.count = 0;
+        start = now_seconds();
+        scene_parse(&loaded, NULL, SCENE_FILE_PATH, nob_sb_to_sv(source));
+        parse_ms = fmin(parse_ms, (now_seconds() - start)*1e3);
+        loaded.count = 0;
+        start = now_seconds();
+        ok = scene_load_file(&loaded, NULL, SCENE_FILE_PATH);
+        load_ms = fmin(load_ms, (now_seconds() - start)*1e3);
+    }
+    if (ok) {
+        printf("scene file %zu spheres, %.1f MB: save %.1f ms, parse %.1f ms (%.0f MB/s), load %.1f ms\n",
+               (size_t)SCENE_FILE_SPHERES, source.count/1e6, save_ms, parse_ms, source.count/parse_ms/1e3, load_ms);
+    }
+
+    remove(SCENE_FILE_PATH);
+    nob_sb_free(source);
+    nob_da_free(loaded);
+    nob_da_free(scene);
+    return ok;
+}
+
+// Time from nothing to a renderable random1M: generated and compiled, parsed
+// from text and compiled, or mapped from a compiled .bscene. The first frame
+// is timed too, since a mapped scene pages in while it renders.
+static bool bench_startup(void) {
+    Scene scene = {0};
+    scene_random(&scene, STARTUP_SPHERES, RANDOM_SEED);
+    CompiledScene reference = compile_scene(&scene);
+    bool ok = scene_save_file(&scene, NULL, SCENE_FILE_PATH) && save_compiled_scene(&reference, STARTUP_BINARY_PATH);
+    free_compiled_scene(&reference);
+    nob_da_free(scene);
+    if (!ok) return false;
+
+    const char *names[] = {"generate", "text", "binary"};
+    Canvas canvases[NOB_ARRAY_LEN(names)];
+    for (size_t i = 0; i < NOB_ARRAY_LEN(names); i++) {
+        double start = now_seconds();
+        Scene source = {0};
+        CompiledScene compiled = {0};
+        if (i == 0) {
+            scene_random(&source, STARTUP_SPHERES, RANDOM_SEED);
+        } else if (i == 1) {
+            ok = ok && scene_load_file(&source, NULL, SCENE_FILE_PATH);
+        } else {
+            ok = ok && map_compiled_scene(&compiled, STARTUP_BINARY_PATH);
+        }
+        if (i < 2) compiled = compile_scene(&source);
+        double ready_ms = (now_seconds() - start)*1e3;
+
+        canvases[i] = canvas_alloc(STARTUP_WIDTH, STARTUP_HEIGHT);
+        start = now_seconds();
+        if (ok) render_scene(&canvases[i], &compiled, (Vector3){0}, (Vector2){1, 1}, 1);
+        double frame_ms = (now_seconds() - start)*1e3;
+        if (ok) printf("startup %s %d spheres: ready in %8.2f ms, first %dx%d frame %7.2f ms\n",
+                       names[i], STARTUP_SPHERES, ready_ms, STARTUP_WIDTH, STARTUP_HEIGHT, frame_ms);
+        free_compiled_scene(&compiled);
+        nob_da_free(source);
+    }
+    for (size_t i = 1; ok && i < NOB_ARRAY_LEN(names); i++) {
+        if (memcmp(canvases[0].pixels, canvases[i].pixels, (size_t)STARTUP_WIDTH*STARTUP_HEIGHT*sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "ERROR: The %s scene renders differently from the generated one\n", names[i]);
+            ok = false;
+        }
+    }
+
+    for (size_t i = 0; i < NOB_ARRAY_LEN(names); i++) canvas_free(&canvases[i]);
+    remove(SCENE_FILE_PATH);
+    remove(STARTUP_BINARY_PATH);
+    return ok;
+}
+
+// A slider drag as the interactive view sees it: every frame is reprojected
+// from the one before without the full pass in between, which a drag keeps
+// cancelling. Each frame is compared with tracing that view from scratch and
+// timed against one full pass and against the coarse to fine passes, which
+// is what the interactive view runs instead when reprojecting is slower.
+static bool bench_reproject(void) {
+    const char *names[] = {"demo", "mirrors", "random1k", "random100k"};
+    // Per frame camera steps, a few pixels of mouse movement on the c.x and c.z sliders
+    Vector3 drags[] = {{0.02f, 0, 0}, {0, 0, 0.02f}, {0.1f, 0, 0}};
+    RenderPool *pool = render_pool_create(0, RENDER_TILE_SIZE);
+    if (pool == NULL) return false;
+    Canvas reference = canvas_alloc(REPROJECT_WIDTH, REPROJECT_HEIGHT);
+    Canvas coarse = canvas_alloc(REPROJECT_WIDTH, REPROJECT_HEIGHT);
+    Canvas frames[2] = {
+        canvas_alloc(REPROJECT_WIDTH, REPROJECT_HEIGHT),
+        canvas_alloc(REPROJECT_WIDTH, REPROJECT_HEIGHT),
+    };
+    canvas_keep_hits(&frames[0]);
+    canvas_keep_hits(&frames[1]);
+
+    for (size_t s = 0; s < NOB_ARRAY_LEN(names); s++) {
+        Scene scene = {0};
+        if (!scene_by_name(&scene, names[s])) return false;
+        CompiledScene compiled = compile_scene(&scene);
+
+        for (size_t d = 0; d < NOB_ARRAY_LEN(drags); d++) {
+            RenderView view = { .camera = {0}, .v = {1, 1}, .distance = 1 };
+            render_scene_pass(pool, &frames[0], &compiled, view, 1, 0, NULL);
+            ReprojectStats total = {0};
+            double reproject_time = 0, full_time = 0, coarse_time = 0, min_psnr = INFINITY, psnr_sum = 0;
+            for (int f = 1; f <= REPROJECT_FRAMES; f++) {
+                RenderView next = view;
+                next.camera = Vector3Add(view.camera, drags[d]);
+                ReprojectStats stats;
+                double start = now_seconds();
+                render_scene_reproject(pool, &frames[f%2], &frames[(f + 1)%2], &compiled, view, next, &stats, NULL);
+                reproject_time += now_seconds() - start;
+                start = now_seconds();
+                render_scene_pass(pool, &reference, &compiled, next, 1, 0, NULL);
+                full_time += now_seconds() - start;
+                // What the interactive view traces instead when it does not reproject
+                start = now_seconds();
+                for (int step = RENDER_PREVIEW_STEP, previous_step = 0; step >= 1; previous_step = step, step /= 2) {
+                    render_scene_pass(pool, &coarse, &compiled, next, step, previous_step, NULL);
+                }
+                coarse_time += now_seconds() - start;
+
+                CanvasDiff diff = canvas_diff(&reference, &frames[f%2], NULL);
+                // An unchanged frame has infinite PSNR, cap it to keep the mean finite
+                double psnr = diff.psnr < 99 ? diff.psnr : 99;
+                psnr_sum += psnr;
+                if (psnr < min_psnr) min_psnr = psnr;
+                total.pixels += stats.pixels;
+                total.traced += stats.traced;
+                total.invalidated += stats.invalidated;
+                view = next;
+            }
+            printf("reproject %-10s drag (%.2f, %.2f, %.2f) x %d: %5.1f%% rays saved, %5.1f%% invalidated, %7.2f ms vs %7.2f ms full, %7.2f ms coarse (%s), PSNR mean %5.2f min %5.2f dB\n",
+                   names[s], drags[d].x, drags[d].y, drags[d].z, REPROJECT_FRAMES,
+                   100.0*(total.pixels - total.traced)/total.pixels, 100.0*total.invalidated/total.pixels,
+                   reproject_time*1e3/REPROJECT_FRAMES, full_time*1e3/REPROJECT_FRAMES, coarse_time*1e3/REPROJECT_FRAMES,
+                   reproject_time < coarse_time ? "reprojects" : "traces",
+                   psnr_sum/REPROJECT_FRAMES, min_psnr);
+        }
+
+        free_compiled_scene(&compiled);
+        nob_da_free(scene);
+    }
+
+    canvas_free(&frames[1]);
+    canvas_free(&frames[0]);
+    canvas_free(&coarse);
+    canvas_free(&reference);
+    render_pool_destroy(pool);
+    return true;
+}
+
+typedef enum {
+    REPORT_TEXT,
+    REPORT_CSV,
+    REPORT_JSON,
+} ReportFormat;
+
+typedef struct {
+    const char *name;
+    size_t spheres;
+    size_t lights;
+    int runs;
+    double compile_ms;
+    double median_ms;
+    double p95_ms;
+    double mrays;
+    long peak_rss_kb;
+} SuiteResult;
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+    return usage.ru_maxrss;
+}
+
+static SuiteResult suite_run(RenderPool *pool, const char *name, int runs) {
+    Scene scene = {0};
+    bool found = scene_by_name(&scene, name);
+    assert(found);
+    UNUSED(found);
+    double start = now_seconds();
+    CompiledScene compiled = compile_scene(&scene);
+    SuiteResult result = {
+        .name = name,
+        .spheres = compiled.spheres.count,
+        .lights = compiled.lights.count,
+        .runs = runs,
+        .compile_ms = (now_seconds() - start)*1e3,
+    };
+
+    Canvas canvas = canvas_alloc(SUITE_WIDTH, SUITE_HEIGHT);
+    double *times = malloc(runs*sizeof(*times));
+    assert(times != NULL && "Buy more RAM lol");
+
+    // One warm-up frame faults in the canvas and the scene
+    render_scene_parallel(pool, &canvas, &compiled, (Vector3){0}, (Vector2){1, 1}, 1, NULL);
+    for (int i = 0; i < runs; i++) {
+        double frame_start = now_seconds();
+        render_scene_parallel(pool, &canvas, &compiled, (Vector3){0}, (Vector2){1, 1}, 1, NULL);
+        times[i] = (now_seconds() - frame_start)*1e3;
+    }
+    qsort(times, runs, sizeof(*times), compare_doubles);
+    result.median_ms = runs%2 ? times[runs/2] : (times[runs/2 - 1] + times[runs/2])/2;
+    // Nearest rank, so small run counts report a frame that actually happened
+    result.p95_ms = times[(int)ceil(0.95*runs) - 1];
+    result.mrays = (double)SUITE_WIDTH*SUITE_HEIGHT/result.median_ms/1e3;
+    result.peak_rss_kb = peak_rss_kb();
+
+    free(times);
+    canvas_free(&canvas);
+    free_compiled_scene(&compiled);
+    nob_da_free(scene);
+    return result;
+}
+
+static void suite_report(FILE *f, ReportFormat format, SuiteResult *results, size_t count) {
+    switch (format) {
+        case REPORT_TEXT:
+            fprintf(f, "%-12s %8s %6s %11s %10s %10s %9s %12s\n",
+                    "scene", "spheres", "lights", "compile_ms", "median_ms", "p95_ms", "Mrays/s", "peak_rss_kb");
+            for (size_t i = 0; i < count; i++) {
+                SuiteResult *r = &results[i];
+                fprintf(f, "%-12s %8zu %6zu %11.2f %10.2f %10.2f %9.2f %12ld\n",
+                        r->name, r->spheres, r->lights, r->compile_ms, r->median_ms, r->p95_ms, r->mrays, r->peak_rss_kb);
+            }
+            break;
+        case REPORT_CSV:
+            fprintf(f, "scene,width,height,spheres,lights,runs,compile_ms,median_ms,p95_ms,mrays_per_s,peak_rss_kb\n");
+            for (size_t i = 0; i < count; i++) {
+                SuiteResult *r = &results[i];
+                fprintf(f, "%s,%d,%d,%zu,%zu,%d,%.3f,%.3f,%.3f,%.3f,%ld\n",
+                        r->name, SUITE_WIDTH, SUITE_HEIGHT, r->spheres, r->lights, r->runs,
+                        r->compile_ms, r->median_ms, r->p95_ms, r->mrays, r->peak_rss_kb);
+            }
+            break;
+        case REPORT_JSON:
+            fprintf(f, "{\n  \"sphere_kernel\": \"%s\",\n  \"scenes\": [\n", sphere_kernel_name(sphere_kernel_current()));
+            for (size_t i = 0; i < count; i++) {
+                SuiteResult *r = &results[i];
+                fprintf(f, "    {\"scene\": \"%s\", \"width\": %d, \"height\": %d, \"spheres\": %zu, \"lights\": %zu, \"runs\": %d, "
+                        "\"compile_ms\": %.3f, \"median_ms\": %.3f, \"p95_ms\": %.3f, \"mrays_per_s\": %.3f, \"peak_rss_kb\": %ld}%s\n",
+                        r->name, SUITE_WIDTH, SUITE_HEIGHT, r->spheres, r->lights, r->runs,
+                        r->compile_ms, r->median_ms, r->p95_ms, r->mrays, r->peak_rss_kb, i + 1 < count ? "," : "");
+            }
+            fprintf(f, "  ]\n}\n");
+            break;
+    }
+}
+
+// Renders the canonical scenes at a fixed size through the render pool.
+// Peak RSS is the process high-water mark, so scenes run smallest first.
+static bool bench_suite(int runs, ReportFormat format, const char *output) {
+    const char *scenes[] = {"demo", "mirrors", "lights64", "random1k", "random10k", "random100k"};
+    RenderPool *pool = render_pool_create(0, RENDER_TILE_SIZE);
+    if (pool == NULL) return false;
+
+    SuiteResult results[NOB_ARRAY_LEN(scenes)];
+    for (size_t i = 0; i < NOB_ARRAY_LEN(scenes); i++) {
+        results[i] = suite_run(pool, scenes[i], runs);
+    }
+    render_pool_destroy(pool);
+
+    FILE *f = stdout;
+    if (output != NULL) {
+        f = fopen(output, "w");
+        if (f == NULL) {
+            fprintf(stderr, "ERROR: Could not open %s: %s\n", output, strerror(errno));
+            return false;
+        }
+    }
+    suite_report(f, format, results, NOB_ARRAY_LEN(results));
+    if (f != stdout && fclose(f) != 0) {
+        fprintf(stderr, "ERROR: Could not write %s: %s\n", output, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [kernels] [bvh] [packets] [shadows] [lighting] [aa] [ppm] [tonemap] [scenefile] [startup] [reproject] [suite] [options]\n", program);
+    fprintf(stderr, "Runs the named sections, or all of them.\n");
+    fprintf(stderr, "    -runs N                 suite frames per scene (default %d)\n", SUITE_RUNS);
+    fprintf(stderr, "    -format text|csv|json   suite report format (default text)\n");
+    fprintf(stderr, "    -o path                 write the suite report to a file\n");
+}
+
+int main(int argc, char **argv) {
+    const char *program = nob_shift_args(&argc, &argv);
+    bool kernels = false, bvh = false, packets = false, shadows = false, lighting = false, aa = false, ppm = false, tonemap = false, scene_file = false, startup = false, reproject = false, suite = false;
+    int runs = SUITE_RUNS;
+    ReportFormat format = REPORT_TEXT;
+    const char *output = NULL;
+
+    while (argc > 0) {
+        const char *arg = nob_shift_args(&argc, &argv);
+        if (strcmp(arg, "kernels") == 0) {
+            kernels = true;
+        } else if (strcmp(arg, "bvh") == 0) {
+            bvh = true;
+        } else if (strcmp(arg, "packets") == 0) {
+            packets = true;
+        } else if (strcmp(arg, "shadows") == 0) {
+            shadows = true;
+        } else if (strcmp(arg, "lighting") == 0) {
+            lighting = true;
+        } else if (strcmp(arg, "aa") == 0) {
+            aa = true;
+        } else if (strcmp(arg, "ppm") == 0) {
+            ppm = true;
+        } else if (strcmp(arg, "tonemap") == 0) {
+            tonemap = true;
+        } else if (strcmp(arg, "scenefile") == 0) {
+            scene_file = true;
+        } else if (strcmp(arg, "startup") == 0) {
+            startup = true;
+        } else if (strcmp(arg, "reproject") == 0) {
+            reproject = true;
+        } else if (strcmp(arg, "suite") == 0) {
+            suite = true;
+        } else if (strcmp(arg, "-runs") == 0 && argc > 0) {
+            runs = atoi(nob_shift_args(&argc, &argv));
+            if (runs < 1) {
+                fprintf(stderr, "ERROR: -runs expects a positive integer\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "-format") == 0 && argc > 0) {
+            const char *name = nob_shift_args(&argc, &argv);
+            if (strcmp(name, "text") == 0) format = REPORT_TEXT;
+            else if (strcmp(name, "csv") == 0) format = REPORT_CSV;
+            else if (strcmp(name, "json") == 0) format = REPORT_JSON;
+            else {
+                fprintf(stderr, "ERROR: Unknown report format %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(arg, "-o") == 0 && argc > 0) {
+            output = nob_shift_args(&argc, &argv);
+        } else {
+            usage(program);
+            return 1;
+        }
+    }
+    if (!kernels && !bvh && !packets && !shadows && !lighting && !aa && !ppm && !tonemap && !scene_file && !startup && !reproject && !suite) {
+        kernels = bvh = packets = shadows = lighting = aa = ppm = tonemap = scene_file = startup = reproject = suite = true;
+    }
+
+    // csv and json on stdout must not be mixed with the other sections' output
+    bool report_on_stdout = format != REPORT_TEXT && output == NULL;
+    if (report_on_stdout && (kernels || bvh || packets || shadows || lighting || aa || ppm || tonemap || scene_file || startup || reproject)) {
+        fprintf(stderr, "ERROR: csv and json reports go to stdout only when running suite alone, use -o\n");
+        return 1;
+    }
+
+    bool ok = true;
+    if (!report_on_stdout) printf("sphere kernel: %s\n", sphere_kernel_name(sphere_kernel_current()));
+    if (kernels && !bench_sphere_kernels()) ok = false;
+    if (bvh && !bench_bvh()) ok = false;
+    if (packets && !bench_packets()) ok = false;
+    if (shadows && !bench_shadows()) ok = false;
+    if (lighting && !bench_lighting()) ok = false;
+    if (aa && !bench_antialiasing()) ok = false;
+    if (ppm && !bench_ppm()) ok = false;
+    if (tonemap && !bench_tonemap()) ok = false;
+    if (scene_file && !bench_scene_file()) ok = false;
+    if (startup && !bench_startup()) ok = false;
+    if (reproject && !bench_reproject()) ok = false;
+    if (suite && !bench_suite(runs, format, output)) ok = false;
+    return ok ? 0 : 1;
+}
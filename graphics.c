@@ -4,6 +4,9 @@
 #define GRAPHICS_IMPLEMENTATION
 #include "graphics.h"
 
+#define SCENES_IMPLEMENTATION
+#include "scenes.h"
+
 #define INTERACTIVE_MODE
 //#undef INTERACTIVE_MODE
 
@@ -14,194 +17,428 @@
 
 #define WIDTH  800
 #define HEIGHT 600
+// Largest value integer flags accept
+#define OPTION_INT_MAX (1 << 16)
 
-int main(void) {
-    Canvas canvas = {0};
-    canvas.width = WIDTH;
-    canvas.height = HEIGHT;
-    canvas.pixels = calloc(sizeof(uint32_t), canvas.width*canvas.height);
+#ifndef GRAPHICS_TRACE_PATH
+#define GRAPHICS_TRACE_PATH "trace.json"
+#endif
 
-    Vector3 camera = {0, 0, 0};
-    float vw = 1;
-    float vh = 1;
-    float d = 1;
-    Scene scene = {0};
+typedef struct {
+    int width;
+    int height;
+    RenderView view;
+    bool camera_set;        // View flags given on the command line win over the scene file's
+    bool viewport_set;
+    bool distance_set;
+    const char *output;
+    int threads;
+    SampleSettings sampling;
+    int frames;
+    bool headless;
+    const char *scene;
+    const char *compile;
+    const char *check;
+    const char *diff;
+    int max_error;
+    float min_psnr;
+    ToneMap tone;
+    bool resolve;
+    int depth;
+    int ray_budget;
+} Options;
 
-#if 0
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 1,
-                .center = (Vector3){-1, -1, 5},
-                .color = to_c(255, 0, 0)
-            }
-        }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 1,
-                .center = (Vector3){-2, -1.1, 4},
-                .color = to_c(0, 255, 0)
-            }
-        }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 1,
-                .center = (Vector3){1, -1, 4},
-                .color = to_c(0, 0, 255)
-            }
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "Without options opens the interactive window, any option renders headless.\n");
+    fprintf(stderr, "    -size WxH         canvas size (default %dx%d)\n", WIDTH, HEIGHT);
+    fprintf(stderr, "    -camera x,y,z     camera position (default 0,0,0)\n");
+    fprintf(stderr, "    -viewport vw,vh   viewport size (default 1,1)\n");
+    fprintf(stderr, "    -d distance       viewport distance (default 1)\n");
+    fprintf(stderr, "    -o path           output PPM (default canvas.ppm)\n");
+    fprintf(stderr, "    -threads N        render threads, 0 for one per core (default 0)\n");
+    fprintf(stderr, "    -samples N        N x N rays per pixel, up to %d (default 1)\n", RENDER_MAX_SAMPLES);
+    fprintf(stderr, "    -sampling name    grid or jitter (default grid)\n");
+    fprintf(stderr, "    -adaptive T       only supersample pixels differing from a neighbour by more than T, 0..1\n");
+    fprintf(stderr, "    -frames N         frames to render and time (default 1)\n");
+    fprintf(stderr, "    -scene name       demo, mirrors, lights<N>, random<N>, a .scene or a .bscene file (default demo)\n");
+    fprintf(stderr, "    -compile path     write the compiled scene to a .bscene file instead of rendering\n");
+    fprintf(stderr, "    -depth N          reflection bounces, 0 for none (default %d)\n", TRACE_MAX_DEPTH);
+    fprintf(stderr, "    -ray-budget N     reflection rays per pixel sample (default %d)\n", TRACE_RAY_BUDGET);
+    fprintf(stderr, "    -headless         render with the defaults without opening a window\n");
+    fprintf(stderr, "Any of these resolves the frame with a tone map before it is written:\n");
+    fprintf(stderr, "    -exposure EV      exposure in stops (default 0)\n");
+    fprintf(stderr, "    -tonemap curve    clamp, reinhard or aces (default clamp)\n");
+    fprintf(stderr, "    -encode name      linear or srgb (default linear)\n");
+    fprintf(stderr, "Golden image checks compare the last frame instead of writing it:\n");
+    fprintf(stderr, "    -check ref.ppm    reference image, bless one by rendering it with -o\n");
+    fprintf(stderr, "    -max-error N      largest allowed channel difference (default 0)\n");
+    fprintf(stderr, "    -min-psnr dB      smallest allowed PSNR (default 0, off)\n");
+    fprintf(stderr, "    -diff path        heatmap written on failure (default diff.ppm)\n");
+}
+
+static bool parse_int(const char *flag, const char *arg, int min, int *out) {
+    char *end = NULL;
+    long value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < min || value > OPTION_INT_MAX) {
+        fprintf(stderr, "ERROR: %s expects an integer between %d and %d, got '%s'\n", flag, min, OPTION_INT_MAX, arg);
+        return false;
+    }
+    *out = (int)value;
+    return true;
+}
+
+static bool parse_size(const char *arg, int *width, int *height) {
+    char *end = NULL;
+    long w = strtol(arg, &end, 10);
+    if (end == arg || *end != 'x') goto fail;
+    const char *p = end + 1;
+    long h = strtol(p, &end, 10);
+    if (end == p || *end != '\0') goto fail;
+    if (w < 2 || h < 2 || w > 1<<15 || h > 1<<15) goto fail;
+    *width = (int)w;
+    *height = (int)h;
+    return true;
+
+fail:
+    fprintf(stderr, "ERROR: -size expects WxH between 2x2 and 32768x32768, got '%s'\n", arg);
+    return false;
+}
+
+// Parses exactly count floats separated by sep
+static bool parse_floats(const char *flag, const char *arg, char sep, float *out, int count) {
+    const char *p = arg;
+    for (int i = 0; i < count; i++) {
+        char *end = NULL;
+        out[i] = strtof(p, &end);
+        bool last = i + 1 == count;
+        if (end == p || !isfinite(out[i]) || *end != (last ? '\0' : sep)) {
+            fprintf(stderr, "ERROR: %s expects %d numbers separated by '%c', got '%s'\n", flag, count, sep, arg);
+            return false;
         }
-    }));
-#endif
+        p = end + 1;
+    }
+    return true;
+}
 
-#if 1
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 1,
-                .center = (Vector3){0, -1, 3},
-                .color = to_c(255, 0, 0)
-            }
+static bool parse_options(int argc, char **argv, Options *options) {
+    const char *program = nob_shift_args(&argc, &argv);
+    options->headless = argc > 0;
+    while (argc > 0) {
+        const char *flag = nob_shift_args(&argc, &argv);
+        if (strcmp(flag, "-headless") == 0) continue;
+        if (strcmp(flag, "-help") == 0 || strcmp(flag, "--help") == 0) {
+            usage(program);
+            return false;
         }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 1,
-                .center = (Vector3){-2, 0, 4},
-                .color = to_c(0, 255, 0)
-            }
+        if (argc == 0) {
+            fprintf(stderr, "ERROR: %s expects a value\n", flag);
+            usage(program);
+            return false;
         }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 1,
-                .center = (Vector3){2, 0, 4},
-                .color = to_c(0, 0, 255)
+        const char *arg = nob_shift_args(&argc, &argv);
+
+        bool ok = true;
+        if (strcmp(flag, "-size") == 0) {
+            ok = parse_size(arg, &options->width, &options->height);
+        } else if (strcmp(flag, "-camera") == 0) {
+            float c[3];
+            ok = parse_floats(flag, arg, ',', c, 3);
+            options->view.camera = (Vector3){c[0], c[1], c[2]};
+            options->camera_set = true;
+        } else if (strcmp(flag, "-viewport") == 0) {
+            float v[2];
+            ok = parse_floats(flag, arg, ',', v, 2);
+            options->view.v = (Vector2){v[0], v[1]};
+            options->viewport_set = true;
+        } else if (strcmp(flag, "-d") == 0) {
+            ok = parse_floats(flag, arg, ',', &options->view.distance, 1);
+            options->distance_set = true;
+        } else if (strcmp(flag, "-o") == 0) {
+            options->output = arg;
+        } else if (strcmp(flag, "-threads") == 0) {
+            ok = parse_int(flag, arg, 0, &options->threads);
+        } else if (strcmp(flag, "-samples") == 0) {
+            ok = parse_int(flag, arg, 1, &options->sampling.samples);
+            if (ok && options->sampling.samples > RENDER_MAX_SAMPLES) {
+                fprintf(stderr, "ERROR: -samples is at most %d\n", RENDER_MAX_SAMPLES);
+                ok = false;
             }
+        } else if (strcmp(flag, "-sampling") == 0) {
+            ok = strcmp(arg, "grid") == 0 || strcmp(arg, "jitter") == 0;
+            if (!ok) fprintf(stderr, "ERROR: -sampling expects grid or jitter, got '%s'\n", arg);
+            options->sampling.pattern = strcmp(arg, "jitter") == 0 ? SAMPLE_JITTER : SAMPLE_GRID;
+        } else if (strcmp(flag, "-adaptive") == 0) {
+            ok = parse_floats(flag, arg, ',', &options->sampling.adaptive, 1);
+        } else if (strcmp(flag, "-frames") == 0) {
+            ok = parse_int(flag, arg, 1, &options->frames);
+        } else if (strcmp(flag, "-scene") == 0) {
+            options->scene = arg;
+        } else if (strcmp(flag, "-compile") == 0) {
+            options->compile = arg;
+        } else if (strcmp(flag, "-depth") == 0) {
+            ok = parse_int(flag, arg, 0, &options->depth);
+        } else if (strcmp(flag, "-ray-budget") == 0) {
+            ok = parse_int(flag, arg, 0, &options->ray_budget);
+        } else if (strcmp(flag, "-check") == 0) {
+            options->check = arg;
+        } else if (strcmp(flag, "-max-error") == 0) {
+            ok = parse_int(flag, arg, 0, &options->max_error);
+        } else if (strcmp(flag, "-min-psnr") == 0) {
+            ok = parse_floats(flag, arg, ',', &options->min_psnr, 1);
+        } else if (strcmp(flag, "-diff") == 0) {
+            options->diff = arg;
+        } else if (strcmp(flag, "-exposure") == 0) {
+            ok = parse_floats(flag, arg, ',', &options->tone.exposure, 1);
+            options->resolve = true;
+        } else if (strcmp(flag, "-tonemap") == 0) {
+            ok = tone_curve_by_name(arg, &options->tone.curve);
+            if (!ok) fprintf(stderr, "ERROR: Unknown tone curve %s\n", arg);
+            options->resolve = true;
+        } else if (strcmp(flag, "-encode") == 0) {
+            ok = strcmp(arg, "linear") == 0 || strcmp(arg, "srgb") == 0;
+            if (!ok) fprintf(stderr, "ERROR: -encode expects linear or srgb, got '%s'\n", arg);
+            options->tone.srgb = strcmp(arg, "srgb") == 0;
+            options->resolve = true;
+        } else {
+            fprintf(stderr, "ERROR: Unknown option %s\n", flag);
+            usage(program);
+            return false;
         }
-    }));
+        if (!ok) return false;
+    }
+    return true;
+}
+
+static bool check_golden(Options *options, Canvas *canvas) {
+    Canvas expected = {0};
+    if (!canvas_from_ppm_file(&expected, options->check)) return false;
+    if (expected.width != canvas->width || expected.height != canvas->height) {
+        fprintf(stderr, "ERROR: %s is %dx%d but the render is %dx%d\n", options->check,
+                expected.width, expected.height, canvas->width, canvas->height);
+        free(expected.pixels);
+        return false;
+    }
+
+    Canvas heatmap = {
+        .pixels = malloc((size_t)canvas->width*canvas->height*sizeof(uint32_t)),
+        .width = canvas->width,
+        .height = canvas->height,
+    };
+    assert(heatmap.pixels != NULL && "Buy more RAM lol");
+    CanvasDiff diff = canvas_diff(&expected, canvas, &heatmap);
+    bool ok = diff.max_error <= options->max_error && diff.psnr >= options->min_psnr;
+    printf("check %s: %s, max error %d, %zu pixels differ, PSNR %.2f dB\n",
+           options->check, ok ? "ok" : "FAILED", diff.max_error, diff.differing, diff.psnr);
+    if (!ok && canvas_to_ppm_file(&heatmap, options->diff)) {
+        printf("wrote heatmap to %s\n", options->diff);
+    }
+
+    free(heatmap.pixels);
+    free(expected.pixels);
+    return ok;
+}
+
+// Never touches the window, so it runs on machines without a display
+static bool render_headless(Options *options, CompiledScene *compiled) {
+    RenderPool *pool = render_pool_create(options->threads, RENDER_TILE_SIZE);
+    if (pool == NULL) return false;
+
+    Canvas canvas = canvas_alloc(options->width, options->height);
+
+    double rays = 0, total = 0;
+    for (int frame = 0; frame < options->frames; frame++) {
+        SampleHistogram histogram;
+        TRACE_BEGIN(frame_start);
+        size_t allocations = arena_allocation_count();
+        double start = graphics_now();
+        render_scene_sampled(pool, &canvas, compiled, options->view, options->sampling, &histogram);
+        double elapsed = graphics_now() - start;
+        allocations = arena_allocation_count() - allocations;
+        TRACE_END_ARG(frame_start, "frame", frame);
+        total += elapsed;
+        rays += histogram.samples;
+        printf("frame %d: %.2f ms, %.2f Mrays/s, %zu allocations\n", frame, elapsed*1e3, histogram.samples/elapsed/1e6, allocations);
+        if (options->sampling.samples > 1) sample_histogram_print(stdout, &histogram);
+#ifdef GRAPHICS_STATS
+        RenderStats stats;
+        render_stats_collect(&stats);
+        render_stats_print(stdout, &stats);
 #endif
+    }
+    if (options->frames > 1) {
+        printf("average: %.2f ms, %.2f Mrays/s\n", total/options->frames*1e3, rays/total/1e6);
+    }
 
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 5000,
-                .center = (Vector3){0, -5001, 0},
-                .color = to_c(255, 255, 0)
-            }
-        }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_LIGHT,
-        .obj = {
-            .light = (Light){
-                .type = LIGHT_TYPE_AMBIENT,
-                .intensity = 0.2,
-            }
-        }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_LIGHT,
-        .obj = {
-            .light = (Light){
-                .type = LIGHT_TYPE_POINT,
-                .intensity = 0.6,
-                .position = (Vector3){2, 1, 0}
-            }
-        }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_LIGHT,
-        .obj = {
-            .light = (Light){
-                .type = LIGHT_TYPE_DIRECTIONAL,
-                .intensity = 0.2,
-                .direction = (Vector3){1, 4, 4}
+    if (options->resolve) {
+        double start = graphics_now();
+        canvas_resolve(pool, &canvas, options->tone);
+        double elapsed = graphics_now() - start;
+        printf("resolved %s %+.2f EV %s in %.2f ms, %.1f Mpixels/s\n", tone_curve_name(options->tone.curve),
+               options->tone.exposure, options->tone.srgb ? "srgb" : "linear",
+               elapsed*1e3, (double)canvas.width*canvas.height/elapsed/1e6);
+    }
+
+    bool ok = true;
+    if (options->check != NULL) {
+        ok = check_golden(options, &canvas);
+    } else {
+        double start = graphics_now();
+        ok = canvas_to_ppm_file(&canvas, options->output);
+        if (ok) printf("wrote %s in %.2f ms\n", options->output, (graphics_now() - start)*1e3);
+    }
+
+    canvas_free(&canvas);
+    render_pool_destroy(pool);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    Options options = {
+        .width = WIDTH,
+        .height = HEIGHT,
+        .view = { .camera = {0, 0, 0}, .v = {1, 1}, .distance = 1 },
+        .output = "canvas.ppm",
+        .threads = 0,
+        .sampling = { .samples = 1, .pattern = SAMPLE_GRID },
+        .frames = 1,
+        .scene = "demo",
+        .diff = "diff.ppm",
+        .depth = TRACE_MAX_DEPTH,
+        .ray_budget = TRACE_RAY_BUDGET,
+    };
+    if (!parse_options(argc, argv, &options)) return 1;
+#ifndef INTERACTIVE_MODE
+    options.headless = true;
+#endif
+
+    Scene scene = {0};
+    CompiledScene compiled = {0};
+    if (nob_sv_end_with(nob_sv_from_cstr(options.scene), ".bscene")) {
+        double start = graphics_now();
+        if (!map_compiled_scene(&compiled, options.scene)) return 1;
+        printf("mapped %s: %zu spheres, %zu lights in %.2f ms\n", options.scene,
+               compiled.spheres.count, compiled.lights.count, (graphics_now() - start)*1e3);
+    } else if (nob_sv_end_with(nob_sv_from_cstr(options.scene), ".scene")) {
+        RenderView view = options.view;
+        double start = graphics_now();
+        if (!scene_load_file(&scene, &view, options.scene)) return 1;
+        printf("loaded %s: %zu objects in %.2f ms\n", options.scene, scene.count, (graphics_now() - start)*1e3);
+        if (!options.camera_set) options.view.camera = view.camera;
+        if (!options.viewport_set) options.view.v = view.v;
+        if (!options.distance_set) options.view.distance = view.distance;
+    } else if (!scene_by_name(&scene, options.scene)) {
+        return 1;
+    }
+    if (compiled.mapping == NULL) compiled = compile_scene(&scene);
+    if (options.compile != NULL) {
+        bool ok = save_compiled_scene(&compiled, options.compile);
+        if (ok) printf("wrote %s: %zu spheres, %zu lights, %zu BVH nodes\n", options.compile,
+                       compiled.spheres.count, compiled.lights.count, compiled.bvh.count);
+        free_compiled_scene(&compiled);
+        nob_da_free(scene);
+        return ok ? 0 : 1;
+    }
+    compiled.limits.max_depth = options.depth;
+    compiled.limits.ray_budget = options.ray_budget;
+    bool ok = true;
+    TRACE_THREAD_NAME("main");
+
+    if (options.headless) {
+        ok = render_headless(&options, &compiled);
+    } else {
+#ifdef INTERACTIVE_MODE
+        Canvas canvas = canvas_alloc(WIDTH, HEIGHT);
+
+        Vector3 camera = options.view.camera;
+        float vw = options.view.v.x;
+        float vh = options.view.v.y;
+        float d = options.view.distance;
+
+        RenderPool *pool = render_pool_create(0, RENDER_TILE_SIZE);
+        if (pool == NULL) return 1;
+
+        render_scene_parallel(pool, &canvas, &compiled, camera, (Vector2){vw, vh}, d, NULL);
+
+        InitWindow(WIDTH, HEIGHT, "Computer Graphics");
+        Texture2D texture = canvas_to_texture(&canvas);
+        RenderAsync *async = render_async_create(pool, &compiled, &canvas);
+        if (async == NULL) return 1;
+        // Converges the first view and gives camera moves hits to reproject
+        render_async_request(async, (RenderView){camera, (Vector2){vw, vh}, d});
+        SetTargetFPS(120);
+        while (!WindowShouldClose()) {
+            if (IsKeyPressed(KEY_S)) {
+                canvas_to_ppm_file(&canvas, "saved.ppm");
             }
-        }
-    }));
-
-    nob_da_append(&scene, ((SceneObject) {
-        .type = SCENE_OBJECT_SPHERE,
-        .obj = {
-            .sphere = (Sphere){
-                .radius = 5000,
-                .center = (Vector3){0, -5001, 0},
-                .color = to_c(255, 255, 0)
+
+            if (render_async_swap(async)) {
+                TRACE_BEGIN(update_start);
+                ArenaMark mark = arena_mark(arena_scratch());
+                UpdateTexture(texture, canvas_linearize(&canvas, arena_scratch()));
+                arena_rewind(arena_scratch(), mark);
+                TRACE_END(update_start, "UpdateTexture");
             }
-        }
-    }));
 
-    render_scene(&canvas, &scene, camera, (Vector2){vw, vh}, d);
+            TRACE_BEGIN(draw_start);
+            BeginDrawing();
+            {
+                ClearBackground(GetColor(0x181818FF));
+                DrawTexture(texture, 0, 0, WHITE);
+                DrawFPS(WIDTH-120, 50);
+                DrawText(TextFormat("%d spp", render_async_samples(async)), WIDTH-120, 74, 20, LIME);
+                ReprojectStats reprojected = render_async_reproject_stats(async);
+                if (reprojected.pixels > 0) {
+                    DrawText(TextFormat("%.0f%% saved", 100.0*reproject_rays_saved(&reprojected)), WIDTH-120, 98, 20, LIME);
+                }
 
-#ifndef INTERACTIVE_MODE
-    canvas_to_ppm_file(&canvas, "canvas.ppm");
-#else
-    InitWindow(WIDTH, HEIGHT, "Computer Graphics");
-    Texture2D texture = canvas_to_texture(&canvas);
-    canvas.pixels = calloc(sizeof(uint32_t), canvas.width*canvas.height);
-    SetTargetFPS(120);
-    bool should_update_canvas = false;
-    while (!WindowShouldClose()) {
-        if (IsKeyPressed(KEY_S)) {
-            canvas_to_ppm_file(&canvas, "saved.ppm");
-        }
+                int result = 0;
+                int y = 24;
+                result += GuiSlider((Rectangle){24,y,120,30}, "c.x", NULL, &camera.x, -2.5, 2.5);
+                y += 30+2;
+                result += GuiSlider((Rectangle){24,y,120,30}, "c.y", NULL, &camera.y, -2.5, 2.5);
+                y += 30+2;
+                result += GuiSlider((Rectangle){24,y,120,30}, "c.z", NULL, &camera.z, -2.5, 2.5);
+                y += 30+2;
+                result += GuiSlider((Rectangle){24,y,120,30}, "vw", NULL, &vw, -2, 4);
+                y += 30+2;
+                result += GuiSlider((Rectangle){24,y,120,30}, "vh", NULL, &vh, -2, 4);
+                y += 30+2;
+                result += GuiSlider((Rectangle){24,y,120,30}, "d", NULL, &d, 0.5, 1.5);
 
-        if (should_update_canvas) {
-            render_scene(&canvas, &scene, camera, (Vector2){vw, vh}, d);
-            UpdateTexture(texture, canvas.pixels);
-            should_update_canvas = false;
+                if (result > 0) {
+                    render_async_request(async, (RenderView){camera, (Vector2){vw, vh}, d});
+                }
+            }
+            EndDrawing();
+            TRACE_END(draw_start, "draw");
         }
 
-        BeginDrawing();
-        {
-            ClearBackground(GetColor(0x181818FF));
-            DrawTexture(texture, 0, 0, WHITE);
-            DrawFPS(WIDTH-120, 50);
-
-            int result = 0;
-            int y = 24;
-            result += GuiSlider((Rectangle){24,y,120,30}, "c.x", NULL, &camera.x, -2.5, 2.5);
-            y += 30+2;
-            result += GuiSlider((Rectangle){24,y,120,30}, "c.y", NULL, &camera.y, -2.5, 2.5);
-            y += 30+2;
-            result += GuiSlider((Rectangle){24,y,120,30}, "c.z", NULL, &camera.z, -2.5, 2.5);
-            y += 30+2;
-            result += GuiSlider((Rectangle){24,y,120,30}, "vw", NULL, &vw, -2, 4);
-            y += 30+2;
-            result += GuiSlider((Rectangle){24,y,120,30}, "vh", NULL, &vh, -2, 4);
-            y += 30+2;
-            result += GuiSlider((Rectangle){24,y,120,30}, "d", NULL, &d, 0.5, 1.5);
-
-            if (result > 0) should_update_canvas = true;
+        ReprojectStats reprojected = render_async_reproject_stats(async);
+        if (reprojected.frames > 0) {
+            printf("reprojected %llu camera moves: %.1f%% of primary rays saved, %.1f%% traced by settle passes, %.1f%% of hits invalidated\n",
+                   (unsigned long long)reprojected.frames, 100.0*reproject_rays_saved(&reprojected),
+                   100.0*reprojected.settled/reprojected.pixels, 100.0*reprojected.invalidated/reprojected.pixels);
         }
-        EndDrawing();
+        render_async_destroy(async);
+        UnloadTexture(texture);
+        CloseWindow();
+        render_pool_destroy(pool);
+        canvas_free(&canvas);
+#endif
     }
 
-    UnloadTexture(texture);
-    CloseWindow();
-#endif
+    free_compiled_scene(&compiled);
+    nob_da_free(scene);
 
-    free(canvas.pixels);
+#ifdef GRAPHICS_TRACE
+    if (trace_export(GRAPHICS_TRACE_PATH)) {
+        printf("wrote trace to %s\n", GRAPHICS_TRACE_PATH);
+    } else {
+        ok = false;
+    }
+    trace_shutdown();
+#endif
 
-    return 0;
+    return ok ? 0 : 1;
 }
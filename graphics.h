@@ -6,6 +6,17 @@
 #include <stddef.h>
 #include <float.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "raylib.h"
 #include "raymath.h"
@@ -15,12 +26,37 @@
 #define TODO(message) do { fprintf(stderr, "%s:%d: TODO: %s\n", __FILE__, __LINE__, message); abort(); } while(0)
 #define UNREACHABLE(message) do { fprintf(stderr, "%s:%d: UNREACHABLE: %s\n", __FILE__, __LINE__, message); abort(); } while(0)
 
+// What the primary ray through a pixel center hit: a sphere, PIXEL_HIT_NONE
+// for the background or PIXEL_HIT_UNKNOWN until a pass traces the center.
+typedef struct {
+    float t;            // Along canvas_to_viewport's direction, which is not normalized
+    uint32_t sphere;
+    Vector3 normal;
+    uint32_t age;       // Reprojections since the pixel was last traced
+} PixelHit;
+
+#define PIXEL_HIT_NONE UINT32_MAX
+#define PIXEL_HIT_UNKNOWN (UINT32_MAX - 1)
+
+// Renderers write linear float radiance, 1.0 being full 8-bit intensity, as
+// RGBA where A is the summed sample weight. canvas_quantize turns it into
+// pixels. Canvases that are only displayed or saved can leave it NULL.
+// canvas_alloc pads rows to CANVAS_ROW_ALIGN pixels so every row, and every
+// tile column with it, starts on its own cache line; stride 0 means rows are
+// packed at width. hits is only kept by canvases that get reprojected, see
+// canvas_keep_hits.
 typedef struct {
     uint32_t *pixels;
     int width;
     int height;
+    float *radiance;
+    int stride;         // Pixels from one row to the next
+    PixelHit *hits;
 } Canvas;
 
+#define CANVAS_ROW_ALIGN 16
+#define canvas_stride(canvas) ((size_t)((canvas)->stride ? (canvas)->stride : (canvas)->width))
+
 typedef enum {
     SCENE_OBJECT_SPHERE = 1,
     SCENE_OBJECT_LIGHT = 2,
@@ -30,6 +66,8 @@ typedef struct {
     float radius;
     Vector3 center;
     uint32_t color;
+    float specular;     // Phong exponent, 0 or less for matte
+    float reflective;   // 0 matte .. 1 perfect mirror
 } Sphere;
 
 typedef enum {
@@ -61,23 +99,766 @@ typedef struct {
     size_t capacity;
 } Scene;
 
+// Render-side view of a Scene: spheres as structure-of-arrays so the
+// intersection loop streams only the fields it needs, lights packed apart.
+// The float arrays stay readable SCENE_PADDING elements past count, the SIMD
+// kernels load whole vectors and mask off the extra lanes.
+typedef struct {
+    float *cx;
+    float *cy;
+    float *cz;
+    float *radius2;
+    float *specular;
+    float *reflective;
+    uint32_t *color;
+    size_t count;
+} SceneSpheres;
+
+// items as the scene lists them, plus what shading reads, prepared once by
+// scene_lights_prepare: the ambient terms summed up and every other kind in
+// its own arrays, so each gets a loop without a switch on the type
+typedef struct {
+    Light *items;
+    size_t count;
+    float ambient;
+    float *dx;                  // Unit directions towards the directional lights
+    float *dy;
+    float *dz;
+    float *directional_intensity;
+    size_t directional_count;
+    float *px;
+    float *py;
+    float *pz;
+    float *point_intensity;
+    size_t point_count;
+} SceneLights;
+
+// Flattened bounding volume hierarchy over the spheres. Nodes are stored in
+// depth-first order: an interior node's left child is the next node and
+// `first` is the index of its right child; a leaf covers spheres
+// [first, first + count).
+typedef struct {
+    float min[3];
+    uint32_t first;
+    float max[3];
+    uint32_t count;
+} BvhNode;
+
+typedef struct {
+    BvhNode *nodes;
+    size_t count;
+    size_t leaf_count;
+    size_t max_depth;
+    double build_seconds;
+} Bvh;
+
+typedef struct {
+    uint64_t rays;
+    uint64_t nodes_visited;
+    uint64_t leaves_visited;
+    uint64_t sphere_tests;
+} BvhTraversalStats;
+
+#define BVH_MIN_SPHERES 64
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_MAX_DEPTH 64
+#define BVH_BINS 16
+
+// Bump allocator over a chain of blocks. Resetting keeps the blocks, so an
+// arena reset every frame stops calling malloc once it has grown to the
+// frame's high-water mark; arena_allocation_count tells when that happened.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+    size_t block_size;      // Smallest block to malloc, 0 for ARENA_BLOCK_SIZE
+    size_t allocations;     // Blocks this arena took from malloc
+} Arena;
+
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define arena_alloc_array(arena, type, count) ((type *)arena_alloc((arena), (count)*sizeof(type), _Alignof(type)))
+
+// Bounds on the reflection rays spawned below each pixel sample
+typedef struct {
+    int max_depth;      // Reflection bounces, 0 disables reflections
+    int ray_budget;     // Reflection rays per pixel sample whatever the depth
+    float roulette;     // Paths carrying less than this are continued at random
+} TraceLimits;
+
+#define TRACE_MAX_DEPTH 3
+#define TRACE_RAY_BUDGET 8
+#define TRACE_ROULETTE 0.01f
+
+typedef struct {
+    SceneSpheres spheres;
+    SceneLights lights;
+    Bvh bvh;
+    TraceLimits limits;
+    Arena arena;            // Owns every array of a compiled scene
+    void *mapping;          // The arrays point into this file mapping when set, see map_compiled_scene
+    size_t mapping_size;
+} CompiledScene;
+
+// Binary compiled scenes are a SceneFileHeader followed by the sphere, color,
+// light and BVH node arrays exactly as compile_scene lays them out in memory,
+// each at a SCENE_ALIGNMENT aligned offset. Loading maps the file and points
+// the arrays into it. The sizes of Light and BvhNode stand in for the ABI:
+// files only load on builds that lay those out the same way.
+#define SCENE_FILE_MAGIC "GTSCENE"
+#define SCENE_FILE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t light_size;
+    uint32_t node_size;
+    uint64_t size;              // Of the whole file
+    uint64_t sphere_count;
+    uint64_t sphere_stride;     // Floats between the sphere arrays, as in compile_scene
+    uint64_t light_count;
+    uint64_t node_count;        // 0 when the scene has no BVH
+    uint64_t leaf_count;
+    uint64_t max_depth;
+    uint64_t spheres_offset;
+    uint64_t colors_offset;
+    uint64_t lights_offset;
+    uint64_t nodes_offset;
+} SceneFileHeader;
+
+// What is left of TraceLimits for one pixel sample. It is seeded from the
+// pixel, so every render path makes the same roulette decisions.
+typedef struct {
+    int depth;
+    int rays;
+    float throughput;   // Share of the pixel the current ray contributes
+    uint64_t rng;
+} RayBudget;
+
 #define T_MAX FLT_MAX
+#define SCENE_ALIGNMENT 64
+#define SCENE_PADDING 8
+#define scene_align_count(n) (((n) + (SCENE_ALIGNMENT/sizeof(float)) - 1) & ~(SCENE_ALIGNMENT/sizeof(float) - 1))
+#define RENDER_TILE_SIZE 32
+// Interactive previews start at 1/RENDER_PREVIEW_STEP resolution
+#define RENDER_PREVIEW_STEP 8
+// Idle views stop converging after this many samples per pixel
+#define RENDER_ACCUMULATE_MAX 256
+// Carried over shading goes stale, highlights and shadows do not move with
+// the camera. Every packet sized block of pixels is traced again after
+// between half and all of this many reprojections, so the refresh is spread
+// over frames. Must be a power of two.
+#define REPROJECT_MAX_AGE 16
+// Points seen more edge-on than this cosine from the new camera are dropped,
+// their splats would smear across the silhouette
+#define REPROJECT_MIN_COSINE 0.05f
+// A neighbour on another sphere nearer by more than this fraction of t means
+// the pixel may be looking through a crack in a nearer surface
+#define REPROJECT_DEPTH_SLACK 0.05f
+// Seconds without a new request before a reprojected view is traced in full.
+// Drags request every frame, so they never wait this long.
+#define REPROJECT_SETTLE_DELAY 0.2
+// Camera moves are only reprojected while that is faster than the coarse to
+// fine passes that trace the frame from scratch. Once it measured slower, this many moves are traced
+// before it is tried again, since what it costs depends on the view.
+#define REPROJECT_PROBE_INTERVAL 16
+#define RENDER_ACCUMULATE_HZ 10
+#ifndef RENDER_PACKET_SIZE
+#define RENDER_PACKET_SIZE 8
+#endif
+#define PACKET_MAX_SPHERES 64
+#define SPHERE_NONE SIZE_MAX
+// Shadow and reflection rays leave from this far above the surface along N
+// and ignore hits closer than this. The offset is what keeps grazing rays off
+// big spheres like the floor, where float error in the roots exceeds t_min.
+#define RAY_EPSILON 1e-3f
+
+// The SIMD kernels compute the roots in float while the scalar one goes
+// through double sqrt like IntersectRaySphere. The nearest t they report agrees
+// with the scalar kernel within SPHERE_KERNEL_EPSILON*max(1, t); the hit index
+// only differs when two spheres are closer than that along the ray.
+#define SPHERE_KERNEL_EPSILON 1e-5f
+
+typedef enum {
+    SPHERE_KERNEL_AUTO = 0,
+    SPHERE_KERNEL_SCALAR,
+    SPHERE_KERNEL_SSE41,
+    SPHERE_KERNEL_AVX2,
+    SPHERE_KERNEL_COUNT,
+} SphereKernel;
+
+typedef size_t (*IntersectSpheresFn)(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float *closest_t);
+typedef bool (*OccludeSpheresFn)(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float t_max);
+
+typedef struct {
+    int x0, y0;
+    int x1, y1;
+} Tile;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t culled;
+    uint64_t diverged;
+} PacketStats;
+
+typedef struct RenderPool RenderPool;
+
+typedef struct {
+    Vector3 camera;
+    Vector2 v;
+    float distance;
+} RenderView;
+
+typedef enum {
+    SAMPLE_GRID,    // Cell centers of an N x N grid
+    SAMPLE_JITTER,  // One random point in every cell
+} SamplePattern;
+
+// N x N rays per pixel. With adaptive > 0 the frame is traced once per pixel
+// first and only pixels differing from a neighbour by more than adaptive in
+// any channel (0..1 after dividing by weight) get the N x N samples.
+typedef struct {
+    int samples;
+    SamplePattern pattern;
+    float adaptive;
+} SampleSettings;
+
+#define RENDER_MAX_SAMPLES 16
+
+typedef struct {
+    uint64_t pixels[RENDER_MAX_SAMPLES*RENDER_MAX_SAMPLES + 1]; // Indexed by samples taken
+    uint64_t samples;
+} SampleHistogram;
+
+typedef enum {
+    REPROJECT_NONE,
+    REPROJECT_SPLAT,    // Move the previous frame's hits to where they land now
+    REPROJECT_RESOLVE,  // Take over what landed on each pixel and trace the rest
+} ReprojectPhase;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t pixels;
+    uint64_t traced;        // Pixels nothing valid landed on, or next to a nearer surface
+    uint64_t invalidated;   // Previous hits dropped: reflective, too old or edge-on
+    uint64_t settled;       // Pixels of the full passes once the camera stopped, cancelled ones included
+} ReprojectStats;
+
+typedef enum {
+    TONE_CURVE_CLAMP,
+    TONE_CURVE_REINHARD,
+    TONE_CURVE_ACES,
+    TONE_CURVE_COUNT,
+} ToneCurve;
+
+// How canvas_resolve turns radiance into display pixels
+typedef struct {
+    float exposure;     // In stops, 0 keeps the rendered brightness
+    ToneCurve curve;
+    bool srgb;          // Encode with the sRGB transfer curve instead of storing linear values
+} ToneMap;
+
+#define SRGB_LUT_SIZE 4096
+
+// Renders on a background thread into a back buffer, refining from
+// 1/RENDER_PREVIEW_STEP resolution up to full, then keeps adding jittered
+// samples to it while the view stays put. A new request cancels the frame in
+// flight; render_async_swap hands finished passes to the caller, at most
+// RENDER_ACCUMULATE_HZ times a second once it is accumulating.
+typedef struct RenderAsync RenderAsync;
+
+// Writes a PPM while tiles are still being rendered: rows go out in order as
+// soon as every pixel in them has been reported done
+typedef struct {
+    int fd;
+    int width;
+    int height;
+    int next_row;
+    int *pending;
+    uint8_t *buffer;
+    bool failed;
+    pthread_mutex_t lock;
+} PpmStream;
+
+#define PPM_STREAM_ROWS 32
+
+// Build with -DGRAPHICS_STATS to count and time the hot path. Each thread
+// accumulates into its own slot; without the define the hooks compile away.
+#ifdef GRAPHICS_STATS
+typedef enum {
+    STAT_RAYS,
+    STAT_SPHERE_TESTS,
+    STAT_HITS,
+    STAT_LIGHTS,
+    STAT_SHADOW_RAYS,
+    STAT_BOUNCES,
+    STAT_PIXELS,
+    STAT_COUNT,
+} StatCounter;
+
+typedef enum {
+    STAGE_RAYGEN,
+    STAGE_INTERSECT,
+    STAGE_LIGHTING,
+    STAGE_WRITE,
+    STAGE_COUNT,
+} StatStage;
+
+typedef struct {
+    uint64_t counters[STAT_COUNT];
+    uint64_t ns[STAGE_COUNT];
+} RenderStats;
+
+#define GRAPHICS_STATS_MAX_THREADS 256
+#endif // GRAPHICS_STATS
+
+// Build with -DGRAPHICS_TRACE to record timed spans into per-thread ring
+// buffers and export them as Chrome trace JSON (chrome://tracing, Perfetto)
+#ifdef GRAPHICS_TRACE
+#ifndef GRAPHICS_TRACE_EVENTS
+#define GRAPHICS_TRACE_EVENTS (1 << 16) // Per thread, older events get overwritten
+#endif
+#define GRAPHICS_TRACE_MAX_THREADS 256
+
+uint64_t trace_now(void);
+void trace_event(const char *name, uint64_t start_ns, uint64_t end_ns, int64_t arg);
+void trace_thread_name(const char *name);
+bool trace_export(const char *filepath);
+void trace_shutdown(void);
 
+#define TRACE_BEGIN(start) uint64_t start = trace_now()
+#define TRACE_END(start, name) trace_event((name), (start), trace_now(), -1)
+#define TRACE_END_ARG(start, name, arg) trace_event((name), (start), trace_now(), (arg))
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#else
+#define TRACE_BEGIN(start) ((void)0)
+#define TRACE_END(start, name) ((void)0)
+#define TRACE_END_ARG(start, name, arg) ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+#endif // GRAPHICS_TRACE
+
+typedef struct {
+    int max_error;      // Largest difference of any channel, 0..255
+    size_t differing;   // Pixels with any channel off
+    double psnr;        // In dB over the RGB channels, INFINITY when identical
+} CanvasDiff;
+
+void *arena_alloc(Arena *arena, size_t size, size_t align);
+ArenaMark arena_mark(Arena *arena);
+void arena_rewind(Arena *arena, ArenaMark mark);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+Arena *arena_scratch(void);
+size_t arena_allocation_count(void);
 uint8_t clamp_color(int v);
 void put_pixel(Canvas *canvas, int x, int y, uint32_t color);
 void PutPixel(Canvas *canvas, int x, int y, uint32_t color);
+void PutRadiance(Canvas *canvas, int x, int y, Vector3 radiance, float weight);
+void AddRadiance(Canvas *canvas, int x, int y, Vector3 radiance, float weight);
+Canvas canvas_alloc(int width, int height);
+void canvas_keep_hits(Canvas *canvas);
+void canvas_free(Canvas *canvas);
+void canvas_quantize(Canvas *canvas, Tile tile);
+const uint32_t *canvas_linearize(const Canvas *canvas, Arena *arena);
+const char *tone_curve_name(ToneCurve curve);
+bool tone_curve_by_name(const char *name, ToneCurve *curve);
+void canvas_resolve_tile(Canvas *canvas, ToneMap tone, Tile tile);
 Texture2D canvas_to_texture(Canvas *canvas);
 Vector3 canvas_to_viewport(Canvas *canvas, float vw, float vh, float d, float x, float y);
 Vector2 IntersectRaySphere(Vector3 origin, Vector3 direction, Sphere sphere);
-float compute_lighting(Scene *scene, Vector3 P, Vector3 N);
-uint32_t trace_ray(Scene *scene, Vector3 origin, Vector3 direction, float t_min, float t_max);
-void canvas_to_ppm_file(Canvas *canvas, const char *filepath);
-void render_scene(Canvas *canvas, Scene *scene, Vector3 camera, Vector2 v, float distance);
+CompiledScene compile_scene(Scene *scene);
+bool sphere_kernel_supported(SphereKernel kernel);
+SphereKernel sphere_kernel_select(SphereKernel kernel);
+SphereKernel sphere_kernel_current(void);
+const char *sphere_kernel_name(SphereKernel kernel);
+IntersectSpheresFn sphere_kernel_fn(SphereKernel kernel);
+OccludeSpheresFn sphere_kernel_occlude_fn(SphereKernel kernel);
+size_t intersect_spheres(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float *closest_t);
+bool occlude_spheres(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float t_max);
+Bvh bvh_build(SceneSpheres *spheres, Arena *arena);
+size_t bvh_intersect(const Bvh *bvh, const SceneSpheres *spheres, Vector3 origin, Vector3 direction, float t_min, float *closest_t, BvhTraversalStats *stats);
+bool bvh_occluded(const Bvh *bvh, const SceneSpheres *spheres, Vector3 origin, Vector3 direction, float t_min, float t_max, BvhTraversalStats *stats);
+bool scene_occluded(CompiledScene *scene, Vector3 origin, Vector3 direction, float t_min, float t_max);
+void free_compiled_scene(CompiledScene *scene);
+bool save_compiled_scene(const CompiledScene *scene, const char *filepath);
+bool map_compiled_scene(CompiledScene *scene, const char *filepath);
+float compute_lighting(CompiledScene *scene, Vector3 P, Vector3 N, Vector3 V, float specular);
+RayBudget ray_budget_pixel(const CompiledScene *scene, int x, int y, int sample);
+Vector3 trace_ray(CompiledScene *scene, Vector3 origin, Vector3 direction, float t_min, float t_max, RayBudget *budget);
+void trace_packet(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile block, PacketStats *stats);
+void canvas_pack_rgb(const uint32_t *pixels, size_t count, uint8_t *rgb);
+bool canvas_to_ppm_file(Canvas *canvas, const char *filepath);
+bool canvas_from_ppm_file(Canvas *canvas, const char *filepath);
+CanvasDiff canvas_diff(const Canvas *expected, const Canvas *actual, Canvas *heatmap);
+bool ppm_stream_open(PpmStream *stream, const char *filepath, int width, int height);
+void ppm_stream_tile_done(PpmStream *stream, const Canvas *canvas, Tile tile);
+bool ppm_stream_close(PpmStream *stream);
+void render_tile(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile);
+void render_tile_pass(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int step, int previous_step);
+void render_tile_supersampled(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int samples);
+void render_tile_sampled(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int samples, SamplePattern pattern, const uint8_t *mask);
+void render_tile_accumulate(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int sample);
+void render_tile_retrace(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, const uint8_t *mask);
+void render_scene(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance);
+RenderPool *render_pool_create(int thread_count, int tile_size);
+void render_pool_destroy(RenderPool *pool);
+bool render_scene_parallel(RenderPool *pool, Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, const atomic_bool *cancel);
+bool render_scene_pass(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, int step, int previous_step, const atomic_bool *cancel);
+void render_scene_stream(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, PpmStream *stream);
+void render_scene_supersampled(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, int samples);
+void render_scene_sampled(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, SampleSettings sampling, SampleHistogram *histogram);
+bool render_scene_accumulate(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, int sample, const atomic_bool *cancel);
+bool render_scene_reproject(RenderPool *pool, Canvas *canvas, const Canvas *previous, CompiledScene *scene, RenderView from, RenderView to, ReprojectStats *stats, const atomic_bool *cancel);
+void sample_histogram_print(FILE *f, const SampleHistogram *histogram);
+void canvas_resolve(RenderPool *pool, Canvas *canvas, ToneMap tone);
+RenderAsync *render_async_create(RenderPool *pool, CompiledScene *scene, Canvas *front);
+void render_async_destroy(RenderAsync *async);
+void render_async_request(RenderAsync *async, RenderView view);
+bool render_async_swap(RenderAsync *async);
+int render_async_samples(RenderAsync *async);
+ReprojectStats render_async_reproject_stats(RenderAsync *async);
+double reproject_rays_saved(const ReprojectStats *stats);
+#ifdef GRAPHICS_STATS
+void render_stats_collect(RenderStats *total);
+void render_stats_print(FILE *f, const RenderStats *stats);
+#endif // GRAPHICS_STATS
 
 #endif // GRAPHICS_H
 
 #ifdef GRAPHICS_IMPLEMENTATION
 
+#ifdef GRAPHICS_STATS
+typedef struct {
+    _Alignas(64) RenderStats stats;
+    atomic_bool taken;
+} RenderStatsSlot;
+
+static RenderStatsSlot render_stats_slots[GRAPHICS_STATS_MAX_THREADS];
+static atomic_size_t render_stats_used;     // Slots ever handed out, collect sums these
+static pthread_once_t render_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t render_stats_key;
+static _Thread_local RenderStats *render_stats_local;
+
+// Exiting threads give their slot back and its counts wait for the next
+// collect, so pools can come and go without running out of slots
+static void render_stats_release(void *slot) {
+    atomic_store(&((RenderStatsSlot *)slot)->taken, false);
+}
+
+static void render_stats_key_create(void) {
+    pthread_key_create(&render_stats_key, render_stats_release);
+}
+
+static RenderStats *render_stats_thread(void) {
+    if (render_stats_local == NULL) {
+        pthread_once(&render_stats_once, render_stats_key_create);
+        size_t slot = 0;
+        for (; slot < GRAPHICS_STATS_MAX_THREADS; slot++) {
+            bool expected = false;
+            if (atomic_compare_exchange_strong(&render_stats_slots[slot].taken, &expected, true)) break;
+        }
+        assert(slot < GRAPHICS_STATS_MAX_THREADS && "Too many live threads for GRAPHICS_STATS");
+        size_t used = atomic_load(&render_stats_used);
+        while (used <= slot && !atomic_compare_exchange_weak(&render_stats_used, &used, slot + 1)) {}
+        pthread_setspecific(render_stats_key, &render_stats_slots[slot]);
+        render_stats_local = &render_stats_slots[slot].stats;
+    }
+    return render_stats_local;
+}
+
+static uint64_t render_stats_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#define STAT_ADD(counter, n) (render_stats_thread()->counters[(counter)] += (n))
+#define STAT_TIME_BEGIN(name) uint64_t name = render_stats_ns()
+#define STAT_TIME_END(stage, name) (render_stats_thread()->ns[(stage)] += render_stats_ns() - (name))
+
+// Sums and resets every thread's slot. Call it between frames: the slots are
+// plain memory and the pool's handoff is what makes them safe to read.
+void render_stats_collect(RenderStats *total) {
+    memset(total, 0, sizeof(*total));
+    size_t used = atomic_load(&render_stats_used);
+    if (used > GRAPHICS_STATS_MAX_THREADS) used = GRAPHICS_STATS_MAX_THREADS;
+    for (size_t i = 0; i < used; i++) {
+        RenderStats *slot = &render_stats_slots[i].stats;
+        for (size_t c = 0; c < STAT_COUNT; c++) total->counters[c] += slot->counters[c];
+        for (size_t s = 0; s < STAGE_COUNT; s++) total->ns[s] += slot->ns[s];
+        memset(slot, 0, sizeof(*slot));
+    }
+}
+
+void render_stats_print(FILE *f, const RenderStats *stats) {
+    const uint64_t *c = stats->counters;
+    fprintf(f, "stats: %llu rays, %llu sphere tests, %llu hits, %llu lights, %llu shadow rays, %llu bounces, %llu pixels\n",
+            (unsigned long long)c[STAT_RAYS], (unsigned long long)c[STAT_SPHERE_TESTS],
+            (unsigned long long)c[STAT_HITS], (unsigned long long)c[STAT_LIGHTS],
+            (unsigned long long)c[STAT_SHADOW_RAYS], (unsigned long long)c[STAT_BOUNCES],
+            (unsigned long long)c[STAT_PIXELS]);
+    if (c[STAT_PIXELS] > 0) {
+        fprintf(f, "stats: %.3f bounces/pixel, %.3f rays/pixel\n",
+                (double)c[STAT_BOUNCES]/c[STAT_PIXELS], (double)c[STAT_RAYS]/c[STAT_PIXELS]);
+    }
+    static const char *names[STAGE_COUNT] = {
+        [STAGE_RAYGEN]    = "raygen",
+        [STAGE_INTERSECT] = "intersect",
+        [STAGE_LIGHTING]  = "lighting",
+        [STAGE_WRITE]     = "write",
+    };
+    // Thread time, so stages add up to frame time times the thread count
+    double rays = c[STAT_RAYS] > 0 ? (double)c[STAT_RAYS] : 1;
+    fprintf(f, "stats:");
+    for (size_t s = 0; s < STAGE_COUNT; s++) {
+        fprintf(f, " %s %.2f ms (%.1f ns/ray)%s", names[s], stats->ns[s]/1e6, stats->ns[s]/rays, s + 1 < STAGE_COUNT ? "," : "\n");
+    }
+}
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_TIME_BEGIN(name) ((void)0)
+#define STAT_TIME_END(stage, name) ((void)0)
+#endif // GRAPHICS_STATS
+
+#ifdef GRAPHICS_TRACE
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int64_t arg;
+} TraceEvent;
+
+// Single writer per ring: the owning thread publishes head with a release
+// store, trace_export reads it with acquire once the threads have gone quiet.
+// A ring outlives its thread and keeps its events, a later thread takes it
+// over as the same tid.
+typedef struct {
+    atomic_uint_fast64_t head;
+    atomic_bool taken;
+    size_t tid;
+    char name[32];
+    TraceEvent events[GRAPHICS_TRACE_EVENTS];
+} TraceRing;
+
+static TraceRing *trace_rings[GRAPHICS_TRACE_MAX_THREADS];
+static atomic_size_t trace_rings_used;
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static _Thread_local TraceRing *trace_local;
+
+static void trace_release(void *ring) {
+    atomic_store(&((TraceRing *)ring)->taken, false);
+}
+
+static void trace_key_create(void) {
+    pthread_key_create(&trace_key, trace_release);
+}
+
+static TraceRing *trace_ring(void) {
+    if (trace_local == NULL) {
+        pthread_once(&trace_once, trace_key_create);
+        pthread_mutex_lock(&trace_rings_lock);
+        size_t used = atomic_load(&trace_rings_used);
+        size_t slot = 0;
+        for (; slot < used; slot++) {
+            bool expected = false;
+            if (atomic_compare_exchange_strong(&trace_rings[slot]->taken, &expected, true)) break;
+        }
+        if (slot == used) {
+            assert(slot < GRAPHICS_TRACE_MAX_THREADS && "Too many live threads for GRAPHICS_TRACE");
+            TraceRing *ring = calloc(1, sizeof(*ring));
+            assert(ring != NULL && "Buy more RAM lol");
+            ring->tid = slot + 1;
+            atomic_store(&ring->taken, true);
+            trace_rings[slot] = ring;
+            atomic_store(&trace_rings_used, used + 1);
+        }
+        TraceRing *ring = trace_rings[slot];
+        snprintf(ring->name, sizeof(ring->name), "thread %zu", ring->tid);
+        pthread_mutex_unlock(&trace_rings_lock);
+        pthread_setspecific(trace_key, ring);
+        trace_local = ring;
+    }
+    return trace_local;
+}
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// name must outlive the trace, string literals are the intended use
+void trace_event(const char *name, uint64_t start_ns, uint64_t end_ns, int64_t arg) {
+    TraceRing *ring = trace_ring();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->events[head%GRAPHICS_TRACE_EVENTS] = (TraceEvent){ name, start_ns, end_ns, arg };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_thread_name(const char *name) {
+    TraceRing *ring = trace_ring();
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+// Call after rendering has stopped; events still being written are skipped
+bool trace_export(const char *filepath) {
+    FILE *f = fopen(filepath, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+
+    size_t used = atomic_load(&trace_rings_used);
+    if (used > GRAPHICS_TRACE_MAX_THREADS) used = GRAPHICS_TRACE_MAX_THREADS;
+    uint64_t origin = UINT64_MAX;
+    for (size_t i = 0; i < used; i++) {
+        TraceRing *ring = trace_rings[i];
+        if (ring == NULL) continue;
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t first = head > GRAPHICS_TRACE_EVENTS ? head - GRAPHICS_TRACE_EVENTS : 0;
+        for (uint64_t e = first; e < head; e++) {
+            uint64_t start = ring->events[e%GRAPHICS_TRACE_EVENTS].start_ns;
+            if (start < origin) origin = start;
+        }
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    const char *sep = "";
+    for (size_t i = 0; i < used; i++) {
+        TraceRing *ring = trace_rings[i];
+        if (ring == NULL) continue;
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"%s\"}}",
+                sep, ring->tid, ring->name);
+        sep = ",\n";
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t first = head > GRAPHICS_TRACE_EVENTS ? head - GRAPHICS_TRACE_EVENTS : 0;
+        for (uint64_t e = first; e < head; e++) {
+            TraceEvent *event = &ring->events[e%GRAPHICS_TRACE_EVENTS];
+            fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f",
+                    sep, event->name, ring->tid, (event->start_ns - origin)/1e3, (event->end_ns - event->start_ns)/1e3);
+            if (event->arg >= 0) fprintf(f, ", \"args\": {\"value\": %lld}", (long long)event->arg);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "ERROR: Could not write %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Frees every ring. Call it last, once no other thread traces any more; the
+// calling thread starts a fresh ring if it traces again.
+void trace_shutdown(void) {
+    pthread_mutex_lock(&trace_rings_lock);
+    size_t used = atomic_load(&trace_rings_used);
+    for (size_t i = 0; i < used; i++) {
+        free(trace_rings[i]);
+        trace_rings[i] = NULL;
+    }
+    atomic_store(&trace_rings_used, 0);
+    pthread_mutex_unlock(&trace_rings_lock);
+    if (trace_local != NULL) {
+        pthread_setspecific(trace_key, NULL);
+        trace_local = NULL;
+    }
+}
+#endif // GRAPHICS_TRACE
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    size_t used;
+};
+
+// Block data starts on its own cache line
+#define ARENA_HEADER_SIZE ((sizeof(ArenaBlock) + SCENE_ALIGNMENT - 1) & ~(size_t)(SCENE_ALIGNMENT - 1))
+
+static atomic_size_t arena_allocations;
+static _Thread_local Arena arena_scratch_local;
+
+static inline uint8_t *arena_block_data(ArenaBlock *block) {
+    return (uint8_t *)block + ARENA_HEADER_SIZE;
+}
+
+void *arena_alloc(Arena *arena, size_t size, size_t align) {
+    assert(align > 0 && (align & (align - 1)) == 0 && "Alignment must be a power of two");
+    if (align < sizeof(void *)) align = sizeof(void *);
+
+    // Blocks past current are free since the last reset or rewind
+    ArenaBlock *last = NULL;
+    for (ArenaBlock *block = arena->current; block != NULL; block = block->next) {
+        if (block != arena->current) block->used = 0;
+        uintptr_t data = (uintptr_t)arena_block_data(block);
+        size_t offset = ((data + block->used + align - 1) & ~(uintptr_t)(align - 1)) - data;
+        if (offset <= block->size && size <= block->size - offset) {
+            block->used = offset + size;
+            arena->current = block;
+            return arena_block_data(block) + offset;
+        }
+        last = block;
+    }
+
+    size_t capacity = arena->block_size ? arena->block_size : ARENA_BLOCK_SIZE;
+    if (capacity < size + align) capacity = size + align;
+    capacity = (capacity + SCENE_ALIGNMENT - 1) & ~(size_t)(SCENE_ALIGNMENT - 1);
+    ArenaBlock *block = aligned_alloc(SCENE_ALIGNMENT, ARENA_HEADER_SIZE + capacity);
+    assert(block != NULL && "Buy more RAM lol");
+    *block = (ArenaBlock){ .size = capacity, .used = size };
+    if (last) last->next = block;
+    else arena->first = block;
+    arena->current = block;
+    arena->allocations += 1;
+    atomic_fetch_add_explicit(&arena_allocations, 1, memory_order_relaxed);
+    return arena_block_data(block);
+}
+
+ArenaMark arena_mark(Arena *arena) {
+    return (ArenaMark){ arena->current, arena->current ? arena->current->used : 0 };
+}
+
+// Frees everything allocated since mark, keeping the blocks
+void arena_rewind(Arena *arena, ArenaMark mark) {
+    arena->current = mark.block ? mark.block : arena->first;
+    if (arena->current) arena->current->used = mark.used;
+}
+
+void arena_reset(Arena *arena) {
+    arena_rewind(arena, (ArenaMark){0});
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->first;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    *arena = (Arena){ .block_size = arena->block_size };
+}
+
+// The calling thread's arena for temporaries. Take a mark and rewind to it
+// when done; render workers reset theirs before every job.
+Arena *arena_scratch(void) {
+    return &arena_scratch_local;
+}
+
+// Blocks taken from malloc by every arena in the process so far
+size_t arena_allocation_count(void) {
+    return atomic_load_explicit(&arena_allocations, memory_order_relaxed);
+}
+
 uint8_t clamp_color(int v) {
     if (v < 0) return 0;
     if (v > 255) return 255;
@@ -96,7 +877,7 @@ uint8_t clamp_color(int v) {
 void put_pixel(Canvas *canvas, int x, int y, uint32_t color) {
     assert(0 <= x && x < canvas->width && "Overflow x");
     assert(0 <= y && y < canvas->height && "Overflow y");
-    canvas->pixels[y*canvas->width+x] = color;
+    canvas->pixels[y*canvas_stride(canvas) + x] = color;
 }
 
 void PutPixel(Canvas *canvas, int x, int y, uint32_t color) {
@@ -105,27 +886,280 @@ void PutPixel(Canvas *canvas, int x, int y, uint32_t color) {
     put_pixel(canvas, (canvas->width/2)+x, (canvas->height/2)-y-1, color);
 }
 
+// Same coordinates as PutPixel; radiance is the sum of weight samples
+void PutRadiance(Canvas *canvas, int x, int y, Vector3 radiance, float weight) {
+    STAT_TIME_BEGIN(start);
+    assert(-canvas->width/2 <= x && x < canvas->width/2 && "Overflow x");
+    assert(-canvas->height/2 <= y && y < canvas->height/2 && "Overflow y");
+    size_t i = (size_t)((canvas->height/2)-y-1)*canvas_stride(canvas) + (canvas->width/2)+x;
+    float *p = &canvas->radiance[4*i];
+    p[0] = radiance.x;
+    p[1] = radiance.y;
+    p[2] = radiance.z;
+    p[3] = weight;
+    STAT_ADD(STAT_PIXELS, 1);
+    STAT_TIME_END(STAGE_WRITE, start);
+}
+
+// Like PutRadiance but adds to what the pixel already holds
+void AddRadiance(Canvas *canvas, int x, int y, Vector3 radiance, float weight) {
+    STAT_TIME_BEGIN(start);
+    assert(-canvas->width/2 <= x && x < canvas->width/2 && "Overflow x");
+    assert(-canvas->height/2 <= y && y < canvas->height/2 && "Overflow y");
+    size_t i = (size_t)((canvas->height/2)-y-1)*canvas_stride(canvas) + (canvas->width/2)+x;
+    float *p = &canvas->radiance[4*i];
+    p[0] += radiance.x;
+    p[1] += radiance.y;
+    p[2] += radiance.z;
+    p[3] += weight;
+    STAT_ADD(STAT_PIXELS, 1);
+    STAT_TIME_END(STAGE_WRITE, start);
+}
+
+Canvas canvas_alloc(int width, int height) {
+    int stride = (width + CANVAS_ROW_ALIGN - 1) & ~(CANVAS_ROW_ALIGN - 1);
+    size_t count = (size_t)stride*height;
+    Canvas canvas = {
+        .pixels = aligned_alloc(SCENE_ALIGNMENT, count*sizeof(uint32_t)),
+        .width = width,
+        .height = height,
+        .radiance = aligned_alloc(SCENE_ALIGNMENT, 4*count*sizeof(float)),
+        .stride = stride,
+    };
+    assert(canvas.pixels != NULL && canvas.radiance != NULL && "Buy more RAM lol");
+    memset(canvas.pixels, 0, count*sizeof(uint32_t));
+    memset(canvas.radiance, 0, 4*count*sizeof(float));
+    return canvas;
+}
+
+// Starts recording the primary hits of every pass that traces pixel centers
+void canvas_keep_hits(Canvas *canvas) {
+    size_t count = canvas_stride(canvas)*canvas->height;
+    canvas->hits = aligned_alloc(SCENE_ALIGNMENT, (count*sizeof(PixelHit) + SCENE_ALIGNMENT - 1) & ~(size_t)(SCENE_ALIGNMENT - 1));
+    assert(canvas->hits != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < count; i++) {
+        canvas->hits[i] = (PixelHit){ .t = INFINITY, .sphere = PIXEL_HIT_UNKNOWN };
+    }
+}
+
+static inline void PutHit(Canvas *canvas, int x, int y, PixelHit hit) {
+    if (canvas->hits == NULL) return;
+    canvas->hits[(size_t)((canvas->height/2)-y-1)*canvas_stride(canvas) + (canvas->width/2)+x] = hit;
+}
+
+void canvas_free(Canvas *canvas) {
+    free(canvas->pixels);
+    free(canvas->radiance);
+    free(canvas->hits);
+    *canvas = (Canvas){0};
+}
+
+static inline uint32_t radiance_to_pixel(const float *p) {
+    float k = p[3] > 0 ? 255.0f/p[3] : 0;
+    uint32_t r = (uint32_t)lrintf(Clamp(p[0]*k, 0, 255));
+    uint32_t g = (uint32_t)lrintf(Clamp(p[1]*k, 0, 255));
+    uint32_t b = (uint32_t)lrintf(Clamp(p[2]*k, 0, 255));
+    return to_c(r, g, b);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+// SSE2 is baseline on x86-64, so this needs no dispatch. cvtps rounds to
+// nearest even like lrintf, keeping both paths identical.
+static void canvas_quantize_row(const float *radiance, uint32_t *pixels, size_t count) {
+    const __m128 lo = _mm_setzero_ps();
+    const __m128 hi = _mm_set1_ps(255);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i q[4];
+        for (int j = 0; j < 4; j++) {
+            __m128 p = _mm_loadu_ps(radiance + 4*(i + j));
+            __m128 w = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3));
+            __m128 k = _mm_and_ps(_mm_div_ps(hi, w), _mm_cmpgt_ps(w, lo));
+            q[j] = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(p, k), lo), hi));
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+        _mm_storeu_si128((__m128i *)(pixels + i), _mm_or_si128(packed, alpha));
+    }
+    for (; i < count; i++) pixels[i] = radiance_to_pixel(radiance + 4*i);
+}
+#else
+static void canvas_quantize_row(const float *radiance, uint32_t *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++) pixels[i] = radiance_to_pixel(radiance + 4*i);
+}
+#endif // __x86_64__ || __i386__
+
+// Converts the tile's radiance to opaque RGBA8 pixels, clamping only here
+void canvas_quantize(Canvas *canvas, Tile tile) {
+    STAT_TIME_BEGIN(start);
+    int x = canvas->width/2 + tile.x0;
+    size_t count = (size_t)(tile.x1 - tile.x0);
+    for (int y = tile.y0; y < tile.y1; y++) {
+        size_t i = (size_t)(canvas->height/2 - y - 1)*canvas_stride(canvas) + x;
+        canvas_quantize_row(canvas->radiance + 4*i, canvas->pixels + i, count);
+    }
+    STAT_TIME_END(STAGE_WRITE, start);
+}
+
+// Pixels as width x height without row padding, for texture uploads. That is
+// canvas->pixels itself when the rows are packed, else a copy from arena.
+const uint32_t *canvas_linearize(const Canvas *canvas, Arena *arena) {
+    size_t stride = canvas_stride(canvas);
+    if (stride == (size_t)canvas->width) return canvas->pixels;
+    size_t row_size = (size_t)canvas->width*sizeof(uint32_t);
+    uint32_t *pixels = arena_alloc(arena, row_size*canvas->height, SCENE_ALIGNMENT);
+    for (int y = 0; y < canvas->height; y++) {
+        memcpy(pixels + (size_t)y*canvas->width, canvas->pixels + y*stride, row_size);
+    }
+    return pixels;
+}
+
+static const char *tone_curve_names[TONE_CURVE_COUNT] = {
+    [TONE_CURVE_CLAMP] = "clamp",
+    [TONE_CURVE_REINHARD] = "reinhard",
+    [TONE_CURVE_ACES] = "aces",
+};
+
+const char *tone_curve_name(ToneCurve curve) {
+    assert(curve < TONE_CURVE_COUNT);
+    return tone_curve_names[curve];
+}
+
+bool tone_curve_by_name(const char *name, ToneCurve *curve) {
+    for (int i = 0; i < TONE_CURVE_COUNT; i++) {
+        if (strcmp(name, tone_curve_names[i]) == 0) {
+            *curve = (ToneCurve)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Indexed by the tone mapped value in 0..1, fine enough that neighbouring
+// entries never skip an 8-bit code
+static uint8_t srgb_lut[SRGB_LUT_SIZE];
+static pthread_once_t srgb_lut_once = PTHREAD_ONCE_INIT;
+
+static void srgb_lut_init(void) {
+    for (int i = 0; i < SRGB_LUT_SIZE; i++) {
+        float c = (float)i/(SRGB_LUT_SIZE - 1);
+        float s = c <= 0.0031308f ? 12.92f*c : 1.055f*powf(c, 1/2.4f) - 0.055f;
+        srgb_lut[i] = (uint8_t)lrintf(Clamp(s, 0, 1)*255);
+    }
+}
+
+static inline float tone_curve(ToneCurve curve, float c) {
+    switch (curve) {
+    case TONE_CURVE_CLAMP: break;
+    case TONE_CURVE_REINHARD: c = c/(1 + c); break;
+    // Narkowicz's fit of the ACES filmic curve
+    case TONE_CURVE_ACES: c = (c*(2.51f*c + 0.03f))/(c*(2.43f*c + 0.59f) + 0.14f); break;
+    default: UNREACHABLE("tone_curve");
+    }
+    return fminf(c, 1);
+}
+
+static inline uint32_t tone_map_pixel(const float *p, float scale, ToneMap tone) {
+    float k = p[3] > 0 ? scale/p[3] : 0;
+    uint32_t rgb[3];
+    for (int i = 0; i < 3; i++) {
+        float c = tone_curve(tone.curve, fmaxf(p[i]*k, 0));
+        rgb[i] = tone.srgb ? srgb_lut[lrintf(c*(SRGB_LUT_SIZE - 1))] : (uint32_t)lrintf(c*255);
+    }
+    return to_c(rgb[0], rgb[1], rgb[2]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same steps as tone_map_pixel on one RGBA pixel per register, the weight
+// lane comes along for free and is replaced by opaque alpha at the end
+static void canvas_resolve_row(const float *radiance, uint32_t *pixels, size_t count, ToneMap tone, float scale) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 exposure = _mm_set1_ps(scale);
+    const __m128 range = _mm_set1_ps(tone.srgb ? SRGB_LUT_SIZE - 1 : 255);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i q[4];
+        for (int j = 0; j < 4; j++) {
+            __m128 p = _mm_loadu_ps(radiance + 4*(i + j));
+            __m128 w = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3));
+            __m128 k = _mm_and_ps(_mm_div_ps(exposure, w), _mm_cmpgt_ps(w, zero));
+            __m128 c = _mm_max_ps(_mm_mul_ps(p, k), zero);
+            switch (tone.curve) {
+            case TONE_CURVE_CLAMP: break;
+            case TONE_CURVE_REINHARD: c = _mm_div_ps(c, _mm_add_ps(one, c)); break;
+            case TONE_CURVE_ACES: {
+                __m128 n = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), c), _mm_set1_ps(0.03f)));
+                __m128 d = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), c), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+                c = _mm_div_ps(n, d);
+            } break;
+            default: UNREACHABLE("canvas_resolve_row");
+            }
+            q[j] = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(c, one), range));
+        }
+        if (tone.srgb) {
+            // No gather before AVX2, the lookups are scalar
+            uint32_t index[16];
+            for (int j = 0; j < 4; j++) _mm_storeu_si128((__m128i *)(index + 4*j), q[j]);
+            for (int j = 0; j < 4; j++) {
+                pixels[i + j] = to_c(srgb_lut[index[4*j]], srgb_lut[index[4*j + 1]], srgb_lut[index[4*j + 2]]);
+            }
+        } else {
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+            _mm_storeu_si128((__m128i *)(pixels + i), _mm_or_si128(packed, alpha));
+        }
+    }
+    for (; i < count; i++) pixels[i] = tone_map_pixel(radiance + 4*i, scale, tone);
+}
+#else
+static void canvas_resolve_row(const float *radiance, uint32_t *pixels, size_t count, ToneMap tone, float scale) {
+    for (size_t i = 0; i < count; i++) pixels[i] = tone_map_pixel(radiance + 4*i, scale, tone);
+}
+#endif // __x86_64__ || __i386__
+
+// Like canvas_quantize but with exposure, a tone curve and the output encoding
+void canvas_resolve_tile(Canvas *canvas, ToneMap tone, Tile tile) {
+    STAT_TIME_BEGIN(start);
+    pthread_once(&srgb_lut_once, srgb_lut_init);
+    float scale = exp2f(tone.exposure);
+    int x = canvas->width/2 + tile.x0;
+    size_t count = (size_t)(tile.x1 - tile.x0);
+    for (int y = tile.y0; y < tile.y1; y++) {
+        size_t i = (size_t)(canvas->height/2 - y - 1)*canvas_stride(canvas) + x;
+        canvas_resolve_row(canvas->radiance + 4*i, canvas->pixels + i, count, tone, scale);
+    }
+    STAT_TIME_END(STAGE_WRITE, start);
+}
+
 Texture2D canvas_to_texture(Canvas *canvas) {
+    Arena *scratch = arena_scratch();
+    ArenaMark mark = arena_mark(scratch);
     Image image = {0};
-    image.data = canvas->pixels;
+    image.data = (void *)canvas_linearize(canvas, scratch);
     image.width = canvas->width;
     image.height = canvas->height;
     image.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
     image.mipmaps = 1;
     Texture2D texture = LoadTextureFromImage(image);
-    UnloadImage(image);
+    arena_rewind(scratch, mark);
     return texture;
 }
 
 Vector3 canvas_to_viewport(Canvas *canvas, float vw, float vh, float d, float x, float y) {
-    return (Vector3){
+    STAT_TIME_BEGIN(start);
+    Vector3 direction = {
         .x = x*vw/canvas->width,
         .y = y*vh/canvas->height,
         .z = d
     };
+    STAT_TIME_END(STAGE_RAYGEN, start);
+    return direction;
 }
 
 Vector2 IntersectRaySphere(Vector3 origin, Vector3 direction, Sphere sphere) {
+    STAT_ADD(STAT_SPHERE_TESTS, 1);
     Vector3 CO = Vector3Subtract(origin, sphere.center);
 
     float a = Vector3DotProduct(direction, direction);
@@ -142,107 +1176,2656 @@ Vector2 IntersectRaySphere(Vector3 origin, Vector3 direction, Sphere sphere) {
     return (Vector2){t1, t2};
 }
 
-float compute_lighting(Scene *scene, Vector3 P, Vector3 N) {
-    float intensity = 0.0;
-    float length_n = Vector3Length(N);
-    for (size_t i = 0; i < scene->count; i++) {
-        switch (scene->items[i].type) {
-            case SCENE_OBJECT_SPHERE:
-                continue;
-            case SCENE_OBJECT_LIGHT: {
-                Light light = scene->items[i].obj.light;
-                Vector3 L;
-                if (light.type == LIGHT_TYPE_AMBIENT) {
-                    intensity += light.intensity;
-                } else {
-                    if (light.type == LIGHT_TYPE_DIRECTIONAL) {
-                        L = Vector3Subtract(light.position, P);
-                    } else {
-                        assert(light.type == LIGHT_TYPE_POINT);
-                        L = light.direction;
-                    }
-                    float n_dot_l = Vector3DotProduct(N, L);
-                    if (n_dot_l > 0) {
-                        intensity += light.intensity * n_dot_l/(length_n * Vector3Length(L));
-                    }
-                }
-            } break;
+// Fills the shading arrays of lights from its items
+static void scene_lights_prepare(SceneLights *lights, Arena *arena) {
+    size_t directional_count = 0, point_count = 0;
+    lights->ambient = 0;
+    for (size_t i = 0; i < lights->count; i++) {
+        switch (lights->items[i].type) {
+            case LIGHT_TYPE_AMBIENT:
+                lights->ambient += lights->items[i].intensity;
+                break;
+            case LIGHT_TYPE_POINT:
+                point_count += 1;
+                break;
+            case LIGHT_TYPE_DIRECTIONAL:
+                directional_count += 1;
+                break;
             default:
-                UNREACHABLE("Only spheres");
+                UNREACHABLE("Unknown light type");
                 break;
         }
     }
-    return intensity;
-}
-
-
-uint32_t trace_ray(Scene *scene, Vector3 origin, Vector3 direction, float t_min, float t_max) {
-    float closest_t = t_max;
+    if (directional_count + point_count == 0) return;
 
-    Sphere *closest_sphere = NULL;
+    float *floats = arena_alloc_array(arena, float, 4*(directional_count + point_count));
+    lights->dx = floats;
+    lights->dy = lights->dx + directional_count;
+    lights->dz = lights->dy + directional_count;
+    lights->directional_intensity = lights->dz + directional_count;
+    lights->px = lights->directional_intensity + directional_count;
+    lights->py = lights->px + point_count;
+    lights->pz = lights->py + point_count;
+    lights->point_intensity = lights->pz + point_count;
+    for (size_t i = 0; i < lights->count; i++) {
+        Light light = lights->items[i];
+        if (light.type == LIGHT_TYPE_DIRECTIONAL) {
+            size_t j = lights->directional_count++;
+            Vector3 L = Vector3Normalize(light.direction);
+            lights->dx[j] = L.x;
+            lights->dy[j] = L.y;
+            lights->dz[j] = L.z;
+            lights->directional_intensity[j] = light.intensity;
+        } else if (light.type == LIGHT_TYPE_POINT) {
+            size_t j = lights->point_count++;
+            lights->px[j] = light.position.x;
+            lights->py[j] = light.position.y;
+            lights->pz[j] = light.position.z;
+            lights->point_intensity[j] = light.intensity;
+        }
+    }
+}
 
+CompiledScene compile_scene(Scene *scene) {
+    CompiledScene compiled = {
+        .limits = {
+            .max_depth = TRACE_MAX_DEPTH,
+            .ray_budget = TRACE_RAY_BUDGET,
+            .roulette = TRACE_ROULETTE,
+        },
+    };
+    size_t sphere_count = 0;
+    size_t light_count = 0;
     for (size_t i = 0; i < scene->count; i++) {
         switch (scene->items[i].type) {
-            case SCENE_OBJECT_SPHERE: {
-                Sphere *sphere = &scene->items[i].obj.sphere;
-                Vector2 ts = IntersectRaySphere(origin, direction, *sphere);
-                float t1 = ts.x;
-                float t2 = ts.y;
-                if (t_min < t1 && t1 < t_max && t1 < closest_t) {
-                    closest_t = t1;
-                    closest_sphere = sphere;
-                }
-                if (t_min < t2 && t2 < t_max && t2 < closest_t) {
-                    closest_t = t2;
-                    closest_sphere = sphere;
-                }
-            } break;
+            case SCENE_OBJECT_SPHERE:
+                sphere_count += 1;
+                break;
             case SCENE_OBJECT_LIGHT:
-                continue;
+                light_count += 1;
+                break;
             default:
                 UNREACHABLE("Only spheres");
                 break;
         }
     }
 
-    if (closest_sphere == NULL) {
-        return to_c(0x18, 0x18, 0x18);
+    // Every sphere array starts on its own cache line, all of them and the
+    // BVH nodes in one arena block sized for the scene
+    size_t stride = scene_align_count(sphere_count);
+    size_t bvh_size = sphere_count >= BVH_MIN_SPHERES ? scene_align_count(2*sphere_count)*sizeof(BvhNode) + SCENE_ALIGNMENT : 0;
+    compiled.arena.block_size = scene_align_count(6*stride + SCENE_PADDING)*sizeof(float) + stride*sizeof(uint32_t)
+                              + light_count*(sizeof(Light) + 4*sizeof(float)) + bvh_size + 4*SCENE_ALIGNMENT;
+    if (stride > 0) {
+        float *floats = arena_alloc(&compiled.arena, scene_align_count(6*stride + SCENE_PADDING)*sizeof(float), SCENE_ALIGNMENT);
+        uint32_t *colors = arena_alloc(&compiled.arena, stride*sizeof(uint32_t), SCENE_ALIGNMENT);
+        compiled.spheres.cx = floats + 0*stride;
+        compiled.spheres.cy = floats + 1*stride;
+        compiled.spheres.cz = floats + 2*stride;
+        compiled.spheres.radius2 = floats + 3*stride;
+        compiled.spheres.specular = floats + 4*stride;
+        compiled.spheres.reflective = floats + 5*stride;
+        compiled.spheres.color = colors;
+    }
+    if (light_count > 0) {
+        compiled.lights.items = arena_alloc_array(&compiled.arena, Light, light_count);
     }
 
-    Vector3 P = Vector3Add(origin, Vector3Scale(direction, closest_t));
-    Vector3 N = Vector3Subtract(P, closest_sphere->center);
-    N = Vector3Scale(N, 1.0/Vector3Length(N));
-    return color_mult(closest_sphere->color, compute_lighting(scene, P, N));
-}
-
-void canvas_to_ppm_file(Canvas *canvas, const char *filepath) {
-    FILE *f = fopen(filepath, "w");
+    for (size_t i = 0; i < scene->count; i++) {
+        SceneObject *object = &scene->items[i];
+        if (object->type == SCENE_OBJECT_SPHERE) {
+            Sphere sphere = object->obj.sphere;
+            size_t j = compiled.spheres.count++;
+            compiled.spheres.cx[j] = sphere.center.x;
+            compiled.spheres.cy[j] = sphere.center.y;
+            compiled.spheres.cz[j] = sphere.center.z;
+            compiled.spheres.radius2[j] = sphere.radius*sphere.radius;
+            compiled.spheres.specular[j] = sphere.specular;
+            compiled.spheres.reflective[j] = sphere.reflective;
+            compiled.spheres.color[j] = sphere.color;
+        } else {
+            compiled.lights.items[compiled.lights.count++] = object->obj.light;
+        }
+    }
+
+    scene_lights_prepare(&compiled.lights, &compiled.arena);
+    if (compiled.spheres.count >= BVH_MIN_SPHERES) {
+        compiled.bvh = bvh_build(&compiled.spheres, &compiled.arena);
+    }
+
+    return compiled;
+}
+
+void free_compiled_scene(CompiledScene *scene) {
+    if (scene->mapping != NULL) munmap(scene->mapping, scene->mapping_size);
+    arena_free(&scene->arena);
+    *scene = (CompiledScene){0};
+}
+
+// N is the unit normal at P, V points from P back towards the viewer. The
+// reflection R = 2N(N.L) - L is as long as L, so R.V/|R| needs no length of R.
+float compute_lighting(CompiledScene *scene, Vector3 P, Vector3 N, Vector3 V, float specular) {
+    const SceneLights *lights = &scene->lights;
+    float intensity = lights->ambient;
+    float length_v = Vector3Length(V);
+    float n_dot_v = Vector3DotProduct(N, V);
+    Vector3 origin = Vector3Add(P, Vector3Scale(N, RAY_EPSILON));
+    STAT_ADD(STAT_LIGHTS, lights->count);
+    for (size_t i = 0; i < lights->directional_count; i++) {
+        Vector3 L = {lights->dx[i], lights->dy[i], lights->dz[i]};
+        float n_dot_l = Vector3DotProduct(N, L);
+        if (n_dot_l <= 0 || scene_occluded(scene, origin, L, RAY_EPSILON, T_MAX)) continue;
+        float light = lights->directional_intensity[i];
+        intensity += light*n_dot_l;
+        if (specular > 0) {
+            float r_dot_v = 2*n_dot_l*n_dot_v - Vector3DotProduct(L, V);
+            if (r_dot_v > 0) intensity += light*powf(r_dot_v/length_v, specular);
+        }
+    }
+    // A point light's L reaches it at t = 1
+    for (size_t i = 0; i < lights->point_count; i++) {
+        Vector3 L = {lights->px[i] - P.x, lights->py[i] - P.y, lights->pz[i] - P.z};
+        float n_dot_l = Vector3DotProduct(N, L);
+        if (n_dot_l <= 0 || scene_occluded(scene, origin, L, RAY_EPSILON, 1)) continue;
+        float light = lights->point_intensity[i];
+        float length_l = sqrtf(Vector3DotProduct(L, L));
+        intensity += light*n_dot_l/length_l;
+        if (specular > 0) {
+            float r_dot_v = 2*n_dot_l*n_dot_v - Vector3DotProduct(L, V);
+            if (r_dot_v > 0) intensity += light*powf(r_dot_v/(length_l*length_v), specular);
+        }
+    }
+    return intensity;
+}
+
+
+// Nearest hit among spheres [begin, end) with t in (t_min, *closest_t).
+// Returns the sphere index and lowers *closest_t, or SPHERE_NONE when nothing
+// in the range beats the current closest_t.
+static size_t intersect_spheres_scalar(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float *closest_t) {
+    float t_max = *closest_t;
+    float closest = t_max;
+    size_t closest_sphere = SPHERE_NONE;
+
+    float a = Vector3DotProduct(direction, direction);
+    for (size_t i = begin; i < end; i++) {
+        Vector3 CO = Vector3Subtract(origin, (Vector3){spheres->cx[i], spheres->cy[i], spheres->cz[i]});
+        float b = 2*Vector3DotProduct(CO, direction);
+        float c = Vector3DotProduct(CO, CO) - spheres->radius2[i];
+
+        float discriminant = b*b - 4*a*c;
+        if (discriminant < 0) continue;
+
+        float t1 = (-b + sqrt(discriminant)) / (2*a);
+        float t2 = (-b - sqrt(discriminant)) / (2*a);
+        if (t_min < t1 && t1 < t_max && t1 < closest) {
+            closest = t1;
+            closest_sphere = i;
+        }
+        if (t_min < t2 && t2 < t_max && t2 < closest) {
+            closest = t2;
+            closest_sphere = i;
+        }
+    }
+
+    *closest_t = closest;
+    return closest_sphere;
+}
+
+// Whether any sphere in [begin, end) is hit with t in (t_min, t_max). Same
+// roots as the closest-hit kernel of the same width, but it returns at the
+// first blocker and keeps no nearest t or index.
+static bool occlude_spheres_scalar(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float t_max) {
+    float a = Vector3DotProduct(direction, direction);
+    for (size_t i = begin; i < end; i++) {
+        Vector3 CO = Vector3Subtract(origin, (Vector3){spheres->cx[i], spheres->cy[i], spheres->cz[i]});
+        float b = 2*Vector3DotProduct(CO, direction);
+        float c = Vector3DotProduct(CO, CO) - spheres->radius2[i];
+
+        float discriminant = b*b - 4*a*c;
+        if (discriminant < 0) continue;
+
+        float t1 = (-b + sqrt(discriminant)) / (2*a);
+        float t2 = (-b - sqrt(discriminant)) / (2*a);
+        if ((t_min < t1 && t1 < t_max) || (t_min < t2 && t2 < t_max)) return true;
+    }
+    return false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPHERE_KERNEL_X86
+
+// Each lane keeps its own nearest hit while walking the spheres in order, so
+// the final reduction picks the smallest t and, on ties, the smallest index,
+// which is exactly what the scalar loop does with its strict comparisons.
+// The roots use q = -(b + sign(b)*sqrt(D))/2, t = q/a and t = c/q: in float the
+// textbook (-b - sqrt(D))/2a cancels badly on large spheres like the floor.
+// Ranges are swept in whole vectors with out-of-range lanes masked off, so a
+// sphere gets the same t no matter which range or kernel width tested it.
+__attribute__((target("sse4.1")))
+static size_t intersect_spheres_sse41(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float *closest_t) {
+    float a = Vector3DotProduct(direction, direction);
+    __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+    __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+    __m128 four_a = _mm_set1_ps(4*a);
+    __m128 va = _mm_set1_ps(a);
+    __m128 minus_half = _mm_set1_ps(-0.5f);
+    __m128 two = _mm_set1_ps(2);
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 tmin = _mm_set1_ps(t_min);
+    __m128 best_t = _mm_set1_ps(*closest_t);
+    __m128i best_i = _mm_set1_epi32(-1);
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i end_index = _mm_set1_epi32((int)end);
+
+    for (size_t i = begin; i < end; i += 4) {
+        __m128 cox = _mm_sub_ps(ox, _mm_loadu_ps(spheres->cx + i));
+        __m128 coy = _mm_sub_ps(oy, _mm_loadu_ps(spheres->cy + i));
+        __m128 coz = _mm_sub_ps(oz, _mm_loadu_ps(spheres->cz + i));
+        __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(cox, dx), _mm_mul_ps(coy, dy)), _mm_mul_ps(coz, dz)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cox, cox), _mm_mul_ps(coy, coy)), _mm_mul_ps(coz, coz)), _mm_loadu_ps(spheres->radius2 + i));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(four_a, c));
+        __m128i lane = _mm_add_epi32(_mm_set1_epi32((int)i), index);
+        __m128 in_range = _mm_castsi128_ps(_mm_cmpgt_epi32(end_index, lane));
+        __m128 hit = _mm_and_ps(in_range, _mm_cmpge_ps(discriminant, zero));
+        if (_mm_movemask_ps(hit) != 0) {
+            __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+            __m128 q = _mm_mul_ps(_mm_add_ps(b, _mm_or_ps(root, _mm_and_ps(b, sign))), minus_half);
+            __m128 t1 = _mm_div_ps(q, va);
+            __m128 t2 = _mm_div_ps(c, q);
+
+            __m128 ok1 = _mm_and_ps(hit, _mm_and_ps(_mm_cmplt_ps(tmin, t1), _mm_cmplt_ps(t1, best_t)));
+            best_t = _mm_blendv_ps(best_t, t1, ok1);
+            best_i = _mm_blendv_epi8(best_i, lane, _mm_castps_si128(ok1));
+            __m128 ok2 = _mm_and_ps(hit, _mm_and_ps(_mm_cmplt_ps(tmin, t2), _mm_cmplt_ps(t2, best_t)));
+            best_t = _mm_blendv_ps(best_t, t2, ok2);
+            best_i = _mm_blendv_epi8(best_i, lane, _mm_castps_si128(ok2));
+        }
+    }
+
+    float lane_t[4];
+    int32_t lane_i[4];
+    _mm_storeu_ps(lane_t, best_t);
+    _mm_storeu_si128((__m128i*)lane_i, best_i);
+
+    size_t closest_sphere = SPHERE_NONE;
+    float closest = *closest_t;
+    for (int k = 0; k < 4; k++) {
+        if (lane_i[k] < 0) continue;
+        if (lane_t[k] < closest || (lane_t[k] == closest && (size_t)lane_i[k] < closest_sphere)) {
+            closest = lane_t[k];
+            closest_sphere = (size_t)lane_i[k];
+        }
+    }
+    *closest_t = closest;
+    return closest_sphere;
+}
+
+__attribute__((target("avx2")))
+static size_t intersect_spheres_avx2(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float *closest_t) {
+    float a = Vector3DotProduct(direction, direction);
+    __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+    __m256 four_a = _mm256_set1_ps(4*a);
+    __m256 va = _mm256_set1_ps(a);
+    __m256 minus_half = _mm256_set1_ps(-0.5f);
+    __m256 two = _mm256_set1_ps(2);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 tmin = _mm256_set1_ps(t_min);
+    __m256 best_t = _mm256_set1_ps(*closest_t);
+    __m256i best_i = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i end_index = _mm256_set1_epi32((int)end);
+
+    for (size_t i = begin; i < end; i += 8) {
+        __m256 cox = _mm256_sub_ps(ox, _mm256_loadu_ps(spheres->cx + i));
+        __m256 coy = _mm256_sub_ps(oy, _mm256_loadu_ps(spheres->cy + i));
+        __m256 coz = _mm256_sub_ps(oz, _mm256_loadu_ps(spheres->cz + i));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cox, dx), _mm256_mul_ps(coy, dy)), _mm256_mul_ps(coz, dz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cox, cox), _mm256_mul_ps(coy, coy)), _mm256_mul_ps(coz, coz)), _mm256_loadu_ps(spheres->radius2 + i));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(four_a, c));
+        __m256i lane = _mm256_add_epi32(_mm256_set1_epi32((int)i), index);
+        __m256 in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(end_index, lane));
+        __m256 hit = _mm256_and_ps(in_range, _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ));
+        if (_mm256_movemask_ps(hit) != 0) {
+            __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+            __m256 q = _mm256_mul_ps(_mm256_add_ps(b, _mm256_or_ps(root, _mm256_and_ps(b, sign))), minus_half);
+            __m256 t1 = _mm256_div_ps(q, va);
+            __m256 t2 = _mm256_div_ps(c, q);
+
+            __m256 ok1 = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(tmin, t1, _CMP_LT_OQ), _mm256_cmp_ps(t1, best_t, _CMP_LT_OQ)));
+            best_t = _mm256_blendv_ps(best_t, t1, ok1);
+            best_i = _mm256_blendv_epi8(best_i, lane, _mm256_castps_si256(ok1));
+            __m256 ok2 = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(tmin, t2, _CMP_LT_OQ), _mm256_cmp_ps(t2, best_t, _CMP_LT_OQ)));
+            best_t = _mm256_blendv_ps(best_t, t2, ok2);
+            best_i = _mm256_blendv_epi8(best_i, lane, _mm256_castps_si256(ok2));
+        }
+    }
+
+    float lane_t[8];
+    int32_t lane_i[8];
+    _mm256_storeu_ps(lane_t, best_t);
+    _mm256_storeu_si256((__m256i*)lane_i, best_i);
+
+    size_t closest_sphere = SPHERE_NONE;
+    float closest = *closest_t;
+    for (int k = 0; k < 8; k++) {
+        if (lane_i[k] < 0) continue;
+        if (lane_t[k] < closest || (lane_t[k] == closest && (size_t)lane_i[k] < closest_sphere)) {
+            closest = lane_t[k];
+            closest_sphere = (size_t)lane_i[k];
+        }
+    }
+    *closest_t = closest;
+    return closest_sphere;
+}
+
+__attribute__((target("sse4.1")))
+static bool occlude_spheres_sse41(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float t_max) {
+    float a = Vector3DotProduct(direction, direction);
+    __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+    __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+    __m128 four_a = _mm_set1_ps(4*a);
+    __m128 va = _mm_set1_ps(a);
+    __m128 minus_half = _mm_set1_ps(-0.5f);
+    __m128 two = _mm_set1_ps(2);
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 tmin = _mm_set1_ps(t_min);
+    __m128 tmax = _mm_set1_ps(t_max);
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i end_index = _mm_set1_epi32((int)end);
+
+    for (size_t i = begin; i < end; i += 4) {
+        __m128 cox = _mm_sub_ps(ox, _mm_loadu_ps(spheres->cx + i));
+        __m128 coy = _mm_sub_ps(oy, _mm_loadu_ps(spheres->cy + i));
+        __m128 coz = _mm_sub_ps(oz, _mm_loadu_ps(spheres->cz + i));
+        __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(cox, dx), _mm_mul_ps(coy, dy)), _mm_mul_ps(coz, dz)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cox, cox), _mm_mul_ps(coy, coy)), _mm_mul_ps(coz, coz)), _mm_loadu_ps(spheres->radius2 + i));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(four_a, c));
+        __m128i lane = _mm_add_epi32(_mm_set1_epi32((int)i), index);
+        __m128 in_range = _mm_castsi128_ps(_mm_cmpgt_epi32(end_index, lane));
+        __m128 hit = _mm_and_ps(in_range, _mm_cmpge_ps(discriminant, zero));
+        if (_mm_movemask_ps(hit) != 0) {
+            __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+            __m128 q = _mm_mul_ps(_mm_add_ps(b, _mm_or_ps(root, _mm_and_ps(b, sign))), minus_half);
+            __m128 t1 = _mm_div_ps(q, va);
+            __m128 t2 = _mm_div_ps(c, q);
+            __m128 ok1 = _mm_and_ps(_mm_cmplt_ps(tmin, t1), _mm_cmplt_ps(t1, tmax));
+            __m128 ok2 = _mm_and_ps(_mm_cmplt_ps(tmin, t2), _mm_cmplt_ps(t2, tmax));
+            if (_mm_movemask_ps(_mm_and_ps(hit, _mm_or_ps(ok1, ok2))) != 0) return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((target("avx2")))
+static bool occlude_spheres_avx2(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float t_max) {
+    float a = Vector3DotProduct(direction, direction);
+    __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+    __m256 four_a = _mm256_set1_ps(4*a);
+    __m256 va = _mm256_set1_ps(a);
+    __m256 minus_half = _mm256_set1_ps(-0.5f);
+    __m256 two = _mm256_set1_ps(2);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 tmin = _mm256_set1_ps(t_min);
+    __m256 tmax = _mm256_set1_ps(t_max);
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i end_index = _mm256_set1_epi32((int)end);
+
+    for (size_t i = begin; i < end; i += 8) {
+        __m256 cox = _mm256_sub_ps(ox, _mm256_loadu_ps(spheres->cx + i));
+        __m256 coy = _mm256_sub_ps(oy, _mm256_loadu_ps(spheres->cy + i));
+        __m256 coz = _mm256_sub_ps(oz, _mm256_loadu_ps(spheres->cz + i));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cox, dx), _mm256_mul_ps(coy, dy)), _mm256_mul_ps(coz, dz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cox, cox), _mm256_mul_ps(coy, coy)), _mm256_mul_ps(coz, coz)), _mm256_loadu_ps(spheres->radius2 + i));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(four_a, c));
+        __m256i lane = _mm256_add_epi32(_mm256_set1_epi32((int)i), index);
+        __m256 in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(end_index, lane));
+        __m256 hit = _mm256_and_ps(in_range, _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ));
+        if (_mm256_movemask_ps(hit) != 0) {
+            __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+            __m256 q = _mm256_mul_ps(_mm256_add_ps(b, _mm256_or_ps(root, _mm256_and_ps(b, sign))), minus_half);
+            __m256 t1 = _mm256_div_ps(q, va);
+            __m256 t2 = _mm256_div_ps(c, q);
+            __m256 ok1 = _mm256_and_ps(_mm256_cmp_ps(tmin, t1, _CMP_LT_OQ), _mm256_cmp_ps(t1, tmax, _CMP_LT_OQ));
+            __m256 ok2 = _mm256_and_ps(_mm256_cmp_ps(tmin, t2, _CMP_LT_OQ), _mm256_cmp_ps(t2, tmax, _CMP_LT_OQ));
+            if (_mm256_movemask_ps(_mm256_and_ps(hit, _mm256_or_ps(ok1, ok2))) != 0) return true;
+        }
+    }
+    return false;
+}
+#endif // __x86_64__ || __i386__
+
+static const char *sphere_kernel_names[SPHERE_KERNEL_COUNT] = {
+    [SPHERE_KERNEL_AUTO]   = "auto",
+    [SPHERE_KERNEL_SCALAR] = "scalar",
+    [SPHERE_KERNEL_SSE41]  = "sse4.1",
+    [SPHERE_KERNEL_AVX2]   = "avx2",
+};
+
+static pthread_once_t sphere_kernel_once = PTHREAD_ONCE_INIT;
+static SphereKernel sphere_kernel = SPHERE_KERNEL_SCALAR;
+static IntersectSpheresFn sphere_kernel_impl = intersect_spheres_scalar;
+static OccludeSpheresFn sphere_kernel_occlude_impl = occlude_spheres_scalar;
+
+
+bool sphere_kernel_supported(SphereKernel kernel) {
+    switch (kernel) {
+        case SPHERE_KERNEL_AUTO:
+        case SPHERE_KERNEL_SCALAR:
+            return true;
+#ifdef SPHERE_KERNEL_X86
+        case SPHERE_KERNEL_SSE41:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.1");
+        case SPHERE_KERNEL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+IntersectSpheresFn sphere_kernel_fn(SphereKernel kernel) {
+    switch (kernel) {
+        case SPHERE_KERNEL_SCALAR: return intersect_spheres_scalar;
+#ifdef SPHERE_KERNEL_X86
+        case SPHERE_KERNEL_SSE41:  return intersect_spheres_sse41;
+        case SPHERE_KERNEL_AVX2:   return intersect_spheres_avx2;
+#endif
+        default:                   return NULL;
+    }
+}
+
+OccludeSpheresFn sphere_kernel_occlude_fn(SphereKernel kernel) {
+    switch (kernel) {
+        case SPHERE_KERNEL_SCALAR: return occlude_spheres_scalar;
+#ifdef SPHERE_KERNEL_X86
+        case SPHERE_KERNEL_SSE41:  return occlude_spheres_sse41;
+        case SPHERE_KERNEL_AVX2:   return occlude_spheres_avx2;
+#endif
+        default:                   return NULL;
+    }
+}
+
+static SphereKernel sphere_kernel_set(SphereKernel kernel) {
+    if (kernel == SPHERE_KERNEL_AUTO) {
+        kernel = SPHERE_KERNEL_SCALAR;
+        if (sphere_kernel_supported(SPHERE_KERNEL_SSE41)) kernel = SPHERE_KERNEL_SSE41;
+        if (sphere_kernel_supported(SPHERE_KERNEL_AVX2))  kernel = SPHERE_KERNEL_AVX2;
+    }
+    if (!sphere_kernel_supported(kernel)) {
+        fprintf(stderr, "WARNING: %s sphere kernel is not supported on this CPU, using scalar\n", sphere_kernel_name(kernel));
+        kernel = SPHERE_KERNEL_SCALAR;
+    }
+    sphere_kernel = kernel;
+    sphere_kernel_impl = sphere_kernel_fn(kernel);
+    sphere_kernel_occlude_impl = sphere_kernel_occlude_fn(kernel);
+    return kernel;
+}
+
+static void sphere_kernel_detect(void) {
+    sphere_kernel_set(SPHERE_KERNEL_AUTO);
+}
+
+// Not thread safe: call it before rendering starts, not while frames are in flight
+SphereKernel sphere_kernel_select(SphereKernel kernel) {
+    pthread_once(&sphere_kernel_once, sphere_kernel_detect);
+    return sphere_kernel_set(kernel);
+}
+
+SphereKernel sphere_kernel_current(void) {
+    pthread_once(&sphere_kernel_once, sphere_kernel_detect);
+    return sphere_kernel;
+}
+
+const char *sphere_kernel_name(SphereKernel kernel) {
+    if ((unsigned)kernel >= SPHERE_KERNEL_COUNT) return "unknown";
+    return sphere_kernel_names[kernel];
+}
+
+size_t intersect_spheres(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float *closest_t) {
+    pthread_once(&sphere_kernel_once, sphere_kernel_detect);
+    STAT_ADD(STAT_SPHERE_TESTS, end - begin);
+    return sphere_kernel_impl(spheres, begin, end, origin, direction, t_min, closest_t);
+}
+
+bool occlude_spheres(const SceneSpheres *spheres, size_t begin, size_t end, Vector3 origin, Vector3 direction, float t_min, float t_max) {
+    pthread_once(&sphere_kernel_once, sphere_kernel_detect);
+    STAT_ADD(STAT_SPHERE_TESTS, end - begin);
+    return sphere_kernel_occlude_impl(spheres, begin, end, origin, direction, t_min, t_max);
+}
+
+static double graphics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+typedef struct {
+    Vector3 min;
+    Vector3 max;
+} Aabb;
+
+typedef struct {
+    Aabb bounds;
+    size_t count;
+} BvhBin;
+
+typedef struct {
+    Bvh *bvh;
+    size_t *indices;
+    Aabb *boxes;
+    Vector3 *centroids;
+} BvhBuilder;
+
+static Aabb aabb_empty(void) {
+    return (Aabb){
+        .min = {FLT_MAX, FLT_MAX, FLT_MAX},
+        .max = {-FLT_MAX, -FLT_MAX, -FLT_MAX},
+    };
+}
+
+// Plain comparisons instead of fminf/fmaxf, which end up as libm calls
+static inline float min_f(float a, float b) { return a < b ? a : b; }
+static inline float max_f(float a, float b) { return a > b ? a : b; }
+
+static inline Vector3 vector3_min(Vector3 a, Vector3 b) {
+    return (Vector3){ min_f(a.x, b.x), min_f(a.y, b.y), min_f(a.z, b.z) };
+}
+
+static inline Vector3 vector3_max(Vector3 a, Vector3 b) {
+    return (Vector3){ max_f(a.x, b.x), max_f(a.y, b.y), max_f(a.z, b.z) };
+}
+
+static Aabb aabb_union(Aabb a, Aabb b) {
+    return (Aabb){ .min = vector3_min(a.min, b.min), .max = vector3_max(a.max, b.max) };
+}
+
+static Aabb aabb_grow(Aabb a, Vector3 p) {
+    return (Aabb){ .min = vector3_min(a.min, p), .max = vector3_max(a.max, p) };
+}
+
+static float aabb_area(Aabb a) {
+    Vector3 e = Vector3Subtract(a.max, a.min);
+    if (e.x < 0 || e.y < 0 || e.z < 0) return 0;
+    return 2*(e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+static float vector3_axis(Vector3 v, int axis) {
+    return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+static size_t bvh_make_leaf(BvhBuilder *b, size_t node, size_t begin, size_t end) {
+    b->bvh->nodes[node].first = (uint32_t)begin;
+    b->bvh->nodes[node].count = (uint32_t)(end - begin);
+    b->bvh->leaf_count += 1;
+    return node;
+}
+
+// Builds the subtree for indices [begin, end) in depth-first order: the left
+// child always directly follows its parent, the right child index is stored.
+static size_t bvh_build_node(BvhBuilder *b, size_t begin, size_t end, size_t depth) {
+    Bvh *bvh = b->bvh;
+    size_t node = bvh->count++;
+    size_t count = end - begin;
+    if (depth > bvh->max_depth) bvh->max_depth = depth;
+
+    Aabb bounds = aabb_empty();
+    Aabb centroid_bounds = aabb_empty();
+    for (size_t i = begin; i < end; i++) {
+        bounds = aabb_union(bounds, b->boxes[b->indices[i]]);
+        centroid_bounds = aabb_grow(centroid_bounds, b->centroids[b->indices[i]]);
+    }
+    bvh->nodes[node] = (BvhNode){
+        .min = {bounds.min.x, bounds.min.y, bounds.min.z},
+        .max = {bounds.max.x, bounds.max.y, bounds.max.z},
+    };
+
+    if (count <= 2 || depth + 1 >= BVH_MAX_DEPTH) return bvh_make_leaf(b, node, begin, end);
+
+    // Binned SAH over the centroids, traversal and sphere test both cost 1
+    float best_cost = FLT_MAX;
+    int best_axis = -1;
+    size_t best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = vector3_axis(centroid_bounds.min, axis);
+        float hi = vector3_axis(centroid_bounds.max, axis);
+        if (hi <= lo) continue;
+
+        BvhBin bins[BVH_BINS];
+        for (size_t k = 0; k < BVH_BINS; k++) bins[k] = (BvhBin){ .bounds = aabb_empty() };
+        float scale = BVH_BINS/(hi - lo);
+        for (size_t i = begin; i < end; i++) {
+            size_t s = b->indices[i];
+            size_t k = (size_t)((vector3_axis(b->centroids[s], axis) - lo)*scale);
+            if (k >= BVH_BINS) k = BVH_BINS - 1;
+            bins[k].count += 1;
+            bins[k].bounds = aabb_union(bins[k].bounds, b->boxes[s]);
+        }
+
+        float right_area[BVH_BINS];
+        size_t right_count[BVH_BINS];
+        Aabb acc = aabb_empty();
+        size_t n = 0;
+        for (size_t k = BVH_BINS - 1; k > 0; k--) {
+            acc = aabb_union(acc, bins[k].bounds);
+            n += bins[k].count;
+            right_area[k] = aabb_area(acc);
+            right_count[k] = n;
+        }
+
+        acc = aabb_empty();
+        n = 0;
+        for (size_t k = 0; k + 1 < BVH_BINS; k++) {
+            acc = aabb_union(acc, bins[k].bounds);
+            n += bins[k].count;
+            if (n == 0 || right_count[k + 1] == 0) continue;
+            float cost = aabb_area(acc)*n + right_area[k + 1]*right_count[k + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = k + 1;
+            }
+        }
+    }
+
+    float leaf_cost = (float)count;
+    float parent_area = aabb_area(bounds);
+    if (best_axis < 0) {
+        // Every centroid coincides, nothing to split on
+        if (count <= BVH_MAX_LEAF_SIZE) return bvh_make_leaf(b, node, begin, end);
+    } else if (count <= BVH_MAX_LEAF_SIZE && parent_area > 0 && 1 + best_cost/parent_area >= leaf_cost) {
+        return bvh_make_leaf(b, node, begin, end);
+    }
+
+    size_t mid;
+    if (best_axis >= 0) {
+        float lo = vector3_axis(centroid_bounds.min, best_axis);
+        float hi = vector3_axis(centroid_bounds.max, best_axis);
+        float scale = BVH_BINS/(hi - lo);
+        size_t i = begin, j = end;
+        while (i < j) {
+            size_t k = (size_t)((vector3_axis(b->centroids[b->indices[i]], best_axis) - lo)*scale);
+            if (k >= BVH_BINS) k = BVH_BINS - 1;
+            if (k < best_split) {
+                i += 1;
+            } else {
+                j -= 1;
+                size_t tmp = b->indices[i];
+                b->indices[i] = b->indices[j];
+                b->indices[j] = tmp;
+            }
+        }
+        mid = i;
+    } else {
+        mid = begin + count/2;
+    }
+
+    bvh_build_node(b, begin, mid, depth + 1);
+    size_t right = bvh_build_node(b, mid, end, depth + 1);
+    bvh->nodes[node].first = (uint32_t)right;
+    bvh->nodes[node].count = 0;
+    return node;
+}
+
+// Builds the hierarchy and reorders the sphere arrays so every leaf covers a
+// contiguous range that the SIMD kernels can sweep. Nodes come from arena,
+// the build's temporaries from the thread's scratch arena.
+Bvh bvh_build(SceneSpheres *spheres, Arena *arena) {
+    Bvh bvh = {0};
+    size_t n = spheres->count;
+    if (n == 0) return bvh;
+
+    double start = graphics_now();
+    Arena *scratch_arena = arena_scratch();
+    ArenaMark mark = arena_mark(scratch_arena);
+    BvhBuilder b = {
+        .bvh = &bvh,
+        .indices = arena_alloc_array(scratch_arena, size_t, n),
+        .boxes = arena_alloc_array(scratch_arena, Aabb, n),
+        .centroids = arena_alloc_array(scratch_arena, Vector3, n),
+    };
+    bvh.nodes = arena_alloc(arena, scene_align_count(2*n)*sizeof(BvhNode), SCENE_ALIGNMENT);
+
+    for (size_t i = 0; i < n; i++) {
+        Vector3 center = {spheres->cx[i], spheres->cy[i], spheres->cz[i]};
+        float radius = sqrtf(spheres->radius2[i]);
+        b.indices[i] = i;
+        b.centroids[i] = center;
+        b.boxes[i] = (Aabb){
+            .min = Vector3AddValue(center, -radius),
+            .max = Vector3AddValue(center, radius),
+        };
+    }
+
+    bvh_build_node(&b, 0, n, 0);
+
+    float *scratch = arena_alloc_array(scratch_arena, float, n);
+    uint32_t *colors = arena_alloc_array(scratch_arena, uint32_t, n);
+    float *arrays[] = {spheres->cx, spheres->cy, spheres->cz, spheres->radius2, spheres->specular, spheres->reflective};
+    for (size_t a = 0; a < sizeof(arrays)/sizeof(arrays[0]); a++) {
+        for (size_t i = 0; i < n; i++) scratch[i] = arrays[a][b.indices[i]];
+        memcpy(arrays[a], scratch, n*sizeof(float));
+    }
+    for (size_t i = 0; i < n; i++) colors[i] = spheres->color[b.indices[i]];
+    memcpy(spheres->color, colors, n*sizeof(uint32_t));
+
+    arena_rewind(scratch_arena, mark);
+    bvh.build_seconds = graphics_now() - start;
+    return bvh;
+}
+
+typedef struct {
+    float ox, oy, oz;
+    float ix, iy, iz;
+} BvhRay;
+
+// Entry distance of the ray into the node box, or FLT_MAX when it misses the
+// (t_min, t_max) interval
+static inline float bvh_node_enter(const BvhNode *node, const BvhRay *ray, float t_min, float t_max) {
+    float tx0 = (node->min[0] - ray->ox)*ray->ix, tx1 = (node->max[0] - ray->ox)*ray->ix;
+    float ty0 = (node->min[1] - ray->oy)*ray->iy, ty1 = (node->max[1] - ray->oy)*ray->iy;
+    float tz0 = (node->min[2] - ray->oz)*ray->iz, tz1 = (node->max[2] - ray->oz)*ray->iz;
+    float t_near = max_f(max_f(min_f(tx0, tx1), min_f(ty0, ty1)), min_f(tz0, tz1));
+    float t_far = min_f(min_f(max_f(tx0, tx1), max_f(ty0, ty1)), max_f(tz0, tz1));
+    if (t_far < t_near || t_far < t_min || t_near > t_max) return FLT_MAX;
+    return t_near;
+}
+
+size_t bvh_intersect(const Bvh *bvh, const SceneSpheres *spheres, Vector3 origin, Vector3 direction, float t_min, float *closest_t, BvhTraversalStats *stats) {
+    BvhRay ray = {
+        .ox = origin.x, .oy = origin.y, .oz = origin.z,
+        .ix = 1.0f/direction.x, .iy = 1.0f/direction.y, .iz = 1.0f/direction.z,
+    };
+    size_t closest_sphere = SPHERE_NONE;
+    uint32_t stack[BVH_MAX_DEPTH];
+    size_t sp = 0;
+    uint32_t node = 0;
+
+    if (stats) stats->rays += 1;
+    if (bvh_node_enter(&bvh->nodes[0], &ray, t_min, *closest_t) == FLT_MAX) return SPHERE_NONE;
+
+    for (;;) {
+        const BvhNode *n = &bvh->nodes[node];
+        if (stats) stats->nodes_visited += 1;
+
+        if (n->count > 0) {
+            if (stats) {
+                stats->leaves_visited += 1;
+                stats->sphere_tests += n->count;
+            }
+            size_t hit = intersect_spheres(spheres, n->first, n->first + n->count, origin, direction, t_min, closest_t);
+            if (hit != SPHERE_NONE) closest_sphere = hit;
+        } else {
+            // Descend into the nearer child first so closest_t shrinks early
+            uint32_t left = node + 1;
+            uint32_t right = n->first;
+            float t_left = bvh_node_enter(&bvh->nodes[left], &ray, t_min, *closest_t);
+            float t_right = bvh_node_enter(&bvh->nodes[right], &ray, t_min, *closest_t);
+            if (t_left > t_right) {
+                uint32_t tmp = left; left = right; right = tmp;
+                float tmp_t = t_left; t_left = t_right; t_right = tmp_t;
+            }
+            if (t_left != FLT_MAX) {
+                if (t_right != FLT_MAX) stack[sp++] = right;
+                node = left;
+                continue;
+            }
+        }
+
+        // Pop, skipping anything the shrunk closest_t already rules out
+        for (;;) {
+            if (sp == 0) return closest_sphere;
+            node = stack[--sp];
+            if (bvh_node_enter(&bvh->nodes[node], &ray, t_min, *closest_t) != FLT_MAX) break;
+        }
+    }
+}
+
+// Any-hit traversal for shadow rays: t_max never shrinks, nodes are not
+// re-tested on pop and the walk ends at the first blocker.
+bool bvh_occluded(const Bvh *bvh, const SceneSpheres *spheres, Vector3 origin, Vector3 direction, float t_min, float t_max, BvhTraversalStats *stats) {
+    BvhRay ray = {
+        .ox = origin.x, .oy = origin.y, .oz = origin.z,
+        .ix = 1.0f/direction.x, .iy = 1.0f/direction.y, .iz = 1.0f/direction.z,
+    };
+    uint32_t stack[BVH_MAX_DEPTH];
+    size_t sp = 0;
+    uint32_t node = 0;
+
+    if (stats) stats->rays += 1;
+    if (bvh_node_enter(&bvh->nodes[0], &ray, t_min, t_max) == FLT_MAX) return false;
+
+    for (;;) {
+        const BvhNode *n = &bvh->nodes[node];
+        if (stats) stats->nodes_visited += 1;
+
+        if (n->count > 0) {
+            if (stats) {
+                stats->leaves_visited += 1;
+                stats->sphere_tests += n->count;
+            }
+            if (occlude_spheres(spheres, n->first, n->first + n->count, origin, direction, t_min, t_max)) return true;
+        } else {
+            // Nearer first still pays off: blockers tend to be close to P
+            uint32_t left = node + 1;
+            uint32_t right = n->first;
+            float t_left = bvh_node_enter(&bvh->nodes[left], &ray, t_min, t_max);
+            float t_right = bvh_node_enter(&bvh->nodes[right], &ray, t_min, t_max);
+            if (t_left > t_right) {
+                uint32_t tmp = left; left = right; right = tmp;
+                float tmp_t = t_left; t_left = t_right; t_right = tmp_t;
+            }
+            if (t_left != FLT_MAX) {
+                if (t_right != FLT_MAX) stack[sp++] = right;
+                node = left;
+                continue;
+            }
+        }
+
+        if (sp == 0) return false;
+        node = stack[--sp];
+    }
+}
+
+bool scene_occluded(CompiledScene *scene, Vector3 origin, Vector3 direction, float t_min, float t_max) {
+    STAT_ADD(STAT_SHADOW_RAYS, 1);
+    if (scene->bvh.count > 0) {
+        return bvh_occluded(&scene->bvh, &scene->spheres, origin, direction, t_min, t_max, NULL);
+    }
+    return occlude_spheres(&scene->spheres, 0, scene->spheres.count, origin, direction, t_min, t_max);
+}
+
+#define CANVAS_BACKGROUND ((Vector3){0x18/255.0f, 0x18/255.0f, 0x18/255.0f})
+
+RayBudget ray_budget_pixel(const CompiledScene *scene, int x, int y, int sample) {
+    // splitmix64 finalizer over the pixel, a zero xorshift state would stick
+    uint64_t z = ((uint64_t)(uint32_t)x << 32 | (uint32_t)y) ^ (uint64_t)sample*0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return (RayBudget){
+        .depth = scene->limits.max_depth,
+        .rays = scene->limits.ray_budget,
+        .throughput = 1,
+        .rng = z ? z : 1,
+    };
+}
+
+static float ray_budget_random(RayBudget *budget) {
+    budget->rng ^= budget->rng << 13;
+    budget->rng ^= budget->rng >> 7;
+    budget->rng ^= budget->rng << 17;
+    return (float)(budget->rng >> 40)/(float)(1ull << 24);
+}
+
+// Reflections blend the local color with what the mirrored ray sees. Once a
+// path carries less than limits.roulette of the pixel it only continues with
+// probability throughput/roulette and is scaled up to stay unbiased.
+static Vector3 shade_hit(CompiledScene *scene, Vector3 origin, Vector3 direction, float t, size_t sphere, RayBudget *budget) {
+    SceneSpheres *spheres = &scene->spheres;
+    Vector3 center = {spheres->cx[sphere], spheres->cy[sphere], spheres->cz[sphere]};
+    Vector3 P = Vector3Add(origin, Vector3Scale(direction, t));
+    Vector3 N = Vector3Subtract(P, center);
+    N = Vector3Scale(N, 1.0/Vector3Length(N));
+    Vector3 V = Vector3Negate(direction);
+    STAT_ADD(STAT_HITS, 1);
+    STAT_TIME_BEGIN(start);
+    float intensity = compute_lighting(scene, P, N, V, spheres->specular[sphere]);
+    STAT_TIME_END(STAGE_LIGHTING, start);
+    uint32_t color = spheres->color[sphere];
+    float k = intensity/255.0f;
+    Vector3 local = {color_r(color)*k, color_g(color)*k, color_b(color)*k};
+
+    float r = spheres->reflective[sphere];
+    if (budget == NULL || r <= 0 || budget->depth <= 0 || budget->rays <= 0) return local;
+    local = Vector3Scale(local, 1 - r);
+    float throughput = budget->throughput*r;
+    float survive = 1;
+    if (throughput < scene->limits.roulette) {
+        survive = throughput/scene->limits.roulette;
+        if (ray_budget_random(budget) >= survive) return local;
+    }
+
+    STAT_ADD(STAT_BOUNCES, 1);
+    float previous = budget->throughput;
+    budget->rays -= 1;
+    budget->depth -= 1;
+    budget->throughput = throughput;
+    Vector3 R = Vector3Subtract(Vector3Scale(N, 2*Vector3DotProduct(N, V)), V);
+    Vector3 reflected = trace_ray(scene, Vector3Add(P, Vector3Scale(N, RAY_EPSILON)), R, RAY_EPSILON, T_MAX, budget);
+    budget->depth += 1;
+    budget->throughput = previous;
+    return Vector3Add(local, Vector3Scale(reflected, r/survive));
+}
+
+static size_t scene_intersect(CompiledScene *scene, Vector3 origin, Vector3 direction, float t_min, float *closest_t) {
+    SceneSpheres *spheres = &scene->spheres;
+    STAT_ADD(STAT_RAYS, 1);
+    STAT_TIME_BEGIN(start);
+    size_t closest_sphere = scene->bvh.count > 0
+        ? bvh_intersect(&scene->bvh, spheres, origin, direction, t_min, closest_t, NULL)
+        : intersect_spheres(spheres, 0, spheres->count, origin, direction, t_min, closest_t);
+    STAT_TIME_END(STAGE_INTERSECT, start);
+    return closest_sphere;
+}
+
+// budget may be NULL to trace without reflections
+Vector3 trace_ray(CompiledScene *scene, Vector3 origin, Vector3 direction, float t_min, float t_max, RayBudget *budget) {
+    float closest_t = t_max;
+    size_t closest_sphere = scene_intersect(scene, origin, direction, t_min, &closest_t);
+    if (closest_sphere == SPHERE_NONE) {
+        return CANVAS_BACKGROUND;
+    }
+    return shade_hit(scene, origin, direction, closest_t, closest_sphere, budget);
+}
+
+static PixelHit pixel_hit(const SceneSpheres *spheres, Vector3 camera, Vector3 direction, float t, size_t sphere) {
+    if (sphere == SPHERE_NONE) return (PixelHit){ .t = INFINITY, .sphere = PIXEL_HIT_NONE };
+    Vector3 P = Vector3Add(camera, Vector3Scale(direction, t));
+    Vector3 N = Vector3Subtract(P, (Vector3){spheres->cx[sphere], spheres->cy[sphere], spheres->cz[sphere]});
+    return (PixelHit){ .t = t, .sphere = (uint32_t)sphere, .normal = Vector3Normalize(N) };
+}
+
+// trace_ray for the primary ray through pixel x, y, which also records what
+// it hit when the canvas keeps hits
+static Vector3 trace_pixel(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector3 direction, int x, int y, RayBudget *budget) {
+    if (canvas->hits == NULL) return trace_ray(scene, camera, direction, 1, T_MAX, budget);
+    float closest_t = T_MAX;
+    size_t closest_sphere = scene_intersect(scene, camera, direction, 1, &closest_t);
+    PutHit(canvas, x, y, pixel_hit(&scene->spheres, camera, direction, closest_t, closest_sphere));
+    if (closest_sphere == SPHERE_NONE) {
+        return CANVAS_BACKGROUND;
+    }
+    return shade_hit(scene, camera, direction, closest_t, closest_sphere, budget);
+}
+
+// Bounds of a block's primary rays: the pyramid spanned by its corner rays
+// plus the cone around the middle ray that contains it. canvas_to_viewport is
+// monotonic in x and y, so every ray of the block is inside both. The cone is
+// what rejects huge spheres like the floor that straddle each side plane.
+typedef struct {
+    Vector3 normals[4];
+    float lengths[4];
+    Vector3 axis;
+    float cos_angle;
+    float sin_angle;
+} Frustum;
+
+// Spheres a packet may hit, copied into a small SoA so each ray does a single
+// kernel sweep. They keep ascending scene order so ties resolve like a full scan.
+typedef struct {
+    float cx[PACKET_MAX_SPHERES + SCENE_PADDING];
+    float cy[PACKET_MAX_SPHERES + SCENE_PADDING];
+    float cz[PACKET_MAX_SPHERES + SCENE_PADDING];
+    float radius2[PACKET_MAX_SPHERES + SCENE_PADDING];
+    uint32_t index[PACKET_MAX_SPHERES];
+    size_t count;
+} PacketSpheres;
+
+// Float rounding lets the kernels report hits up to about sqrt(FLT_EPSILON)
+// radians outside a sphere, so culling keeps a margin of that order
+#define FRUSTUM_SLACK 1e-3f
+
+static Frustum packet_frustum(Canvas *canvas, Vector2 v, float distance, Tile block) {
+    Vector3 corners[4] = {
+        canvas_to_viewport(canvas, v.x, v.y, distance, block.x0, block.y0),
+        canvas_to_viewport(canvas, v.x, v.y, distance, block.x1 - 1, block.y0),
+        canvas_to_viewport(canvas, v.x, v.y, distance, block.x1 - 1, block.y1 - 1),
+        canvas_to_viewport(canvas, v.x, v.y, distance, block.x0, block.y1 - 1),
+    };
+    Vector3 middle = Vector3Add(Vector3Add(corners[0], corners[1]), Vector3Add(corners[2], corners[3]));
+
+    Frustum frustum = { .axis = Vector3Normalize(middle) };
+    float angle = 0;
+    for (int i = 0; i < 4; i++) {
+        Vector3 n = Vector3CrossProduct(corners[i], corners[(i + 1)%4]);
+        // Negative vw/vh or d flip the winding, so orient against the middle ray
+        if (Vector3DotProduct(n, middle) < 0) n = Vector3Negate(n);
+        frustum.normals[i] = n;
+        frustum.lengths[i] = Vector3Length(n);
+
+        float cos_corner = Vector3DotProduct(Vector3Normalize(corners[i]), frustum.axis);
+        float corner = acosf(Clamp(cos_corner, -1, 1));
+        if (corner > angle) angle = corner;
+    }
+    angle = fminf(angle + FRUSTUM_SLACK, PI/2);
+    frustum.cos_angle = cosf(angle);
+    frustum.sin_angle = sinf(angle);
+    return frustum;
+}
+
+static bool frustum_overlaps_sphere(const Frustum *frustum, Vector3 p, float radius) {
+    float dist = Vector3Length(p);
+    if (dist <= radius) return true;
+
+    for (int i = 0; i < 4; i++) {
+        float margin = (radius + FRUSTUM_SLACK*dist)*frustum->lengths[i];
+        if (Vector3DotProduct(frustum->normals[i], p) < -margin) return false;
+    }
+
+    // Angle to the axis minus the sphere's angular radius must fit in the
+    // cone, compared through cosines: cos(phi) >= cos(alpha + angle)
+    float tangent = sqrtf(dist*dist - radius*radius);
+    return Vector3DotProduct(p, frustum->axis) >= tangent*frustum->cos_angle - radius*frustum->sin_angle;
+}
+
+static bool frustum_overlaps_box(const Frustum *frustum, Vector3 min, Vector3 max) {
+    Vector3 center = Vector3Scale(Vector3Add(min, max), 0.5f);
+    float radius = 0.5f*Vector3Distance(min, max);
+    return frustum_overlaps_sphere(frustum, center, radius);
+}
+
+static bool packet_spheres_push(PacketSpheres *active, const SceneSpheres *spheres, size_t i) {
+    if (active->count == PACKET_MAX_SPHERES) return false;
+    size_t j = active->count++;
+    active->cx[j] = spheres->cx[i];
+    active->cy[j] = spheres->cy[i];
+    active->cz[j] = spheres->cz[i];
+    active->radius2[j] = spheres->radius2[i];
+    active->index[j] = (uint32_t)i;
+    return true;
+}
+
+static bool packet_sphere_visible(const Frustum *frustum, const SceneSpheres *spheres, size_t i, Vector3 origin) {
+    Vector3 p = {spheres->cx[i] - origin.x, spheres->cy[i] - origin.y, spheres->cz[i] - origin.z};
+    return frustum_overlaps_sphere(frustum, p, sqrtf(spheres->radius2[i]));
+}
+
+// Returns false when the packet diverges: more spheres survive culling than
+// it is worth sweeping for every ray, so tracing them one by one wins.
+// Single rays already prune the BVH by distance, which the frustum cannot,
+// so a packet gives up once it has visited this many nodes per ray
+#define PACKET_NODES_PER_RAY 4
+
+static bool packet_collect(CompiledScene *scene, const Frustum *frustum, Vector3 origin, size_t rays, PacketSpheres *active) {
+    SceneSpheres *spheres = &scene->spheres;
+    active->count = 0;
+
+    if (scene->bvh.count == 0) {
+        for (size_t i = 0; i < spheres->count; i++) {
+            if (!packet_sphere_visible(frustum, spheres, i, origin)) continue;
+            if (!packet_spheres_push(active, spheres, i)) return false;
+        }
+        return true;
+    }
+
+    // Leaves come out in node order, which is ascending sphere order
+    uint32_t stack[BVH_MAX_DEPTH];
+    size_t sp = 0;
+    size_t budget = rays*PACKET_NODES_PER_RAY;
+    stack[sp++] = 0;
+    while (sp > 0) {
+        if (budget-- == 0) return false;
+        uint32_t index = stack[--sp];
+        const BvhNode *node = &scene->bvh.nodes[index];
+        Vector3 min = {node->min[0] - origin.x, node->min[1] - origin.y, node->min[2] - origin.z};
+        Vector3 max = {node->max[0] - origin.x, node->max[1] - origin.y, node->max[2] - origin.z};
+        if (!frustum_overlaps_box(frustum, min, max)) continue;
+
+        if (node->count > 0) {
+            for (size_t i = node->first; i < node->first + node->count; i++) {
+                if (!packet_sphere_visible(frustum, spheres, i, origin)) continue;
+                if (!packet_spheres_push(active, spheres, i)) return false;
+            }
+        } else {
+            stack[sp++] = node->first;
+            stack[sp++] = index + 1;
+        }
+    }
+    return true;
+}
+
+void trace_packet(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile block, PacketStats *stats) {
+    if (stats) stats->packets += 1;
+
+    PacketSpheres active;
+    Frustum frustum = packet_frustum(canvas, v, distance, block);
+    size_t rays = (size_t)(block.x1 - block.x0)*(size_t)(block.y1 - block.y0);
+    STAT_TIME_BEGIN(collect_start);
+    bool collected = packet_collect(scene, &frustum, camera, rays, &active);
+    STAT_TIME_END(STAGE_INTERSECT, collect_start);
+    if (!collected) {
+        if (stats) stats->diverged += 1;
+        for (int y = block.y0; y < block.y1; y++) {
+            for (int x = block.x0; x < block.x1; x++) {
+                Vector3 direction = canvas_to_viewport(canvas, v.x, v.y, distance, x, y);
+                RayBudget budget = ray_budget_pixel(scene, x, y, 0);
+                PutRadiance(canvas, x, y, trace_pixel(canvas, scene, camera, direction, x, y, &budget), 1);
+            }
+        }
+        return;
+    }
+
+    STAT_ADD(STAT_RAYS, rays);
+    if (active.count == 0) {
+        if (stats) stats->culled += 1;
+        for (int y = block.y0; y < block.y1; y++) {
+            for (int x = block.x0; x < block.x1; x++) {
+                PutRadiance(canvas, x, y, CANVAS_BACKGROUND, 1);
+                PutHit(canvas, x, y, (PixelHit){ .t = INFINITY, .sphere = PIXEL_HIT_NONE });
+            }
+        }
+        return;
+    }
+
+    SceneSpheres view = {
+        .cx = active.cx, .cy = active.cy, .cz = active.cz,
+        .radius2 = active.radius2,
+        .count = active.count,
+    };
+    for (int y = block.y0; y < block.y1; y++) {
+        for (int x = block.x0; x < block.x1; x++) {
+            Vector3 direction = canvas_to_viewport(canvas, v.x, v.y, distance, x, y);
+            float closest_t = T_MAX;
+            STAT_TIME_BEGIN(start);
+            size_t hit = intersect_spheres(&view, 0, view.count, camera, direction, 1, &closest_t);
+            STAT_TIME_END(STAGE_INTERSECT, start);
+            RayBudget budget = ray_budget_pixel(scene, x, y, 0);
+            size_t sphere = hit == SPHERE_NONE ? SPHERE_NONE : active.index[hit];
+            Vector3 radiance = sphere == SPHERE_NONE
+                ? CANVAS_BACKGROUND
+                : shade_hit(scene, camera, direction, closest_t, sphere, &budget);
+            PutRadiance(canvas, x, y, radiance, 1);
+            if (canvas->hits) PutHit(canvas, x, y, pixel_hit(&scene->spheres, camera, direction, closest_t, sphere));
+        }
+    }
+}
+
+static void canvas_pack_rgb_scalar(const uint32_t *pixels, size_t count, uint8_t *rgb) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t c = pixels[i];
+        rgb[3*i + 0] = color_r(c);
+        rgb[3*i + 1] = color_g(c);
+        rgb[3*i + 2] = color_b(c);
+    }
+}
+
+#ifdef SPHERE_KERNEL_X86
+// Drops the alpha byte of 4 pixels per shuffle. Each store writes 16 bytes of
+// which 12 are kept, so the loop stops while 4 bytes of slack remain.
+__attribute__((target("ssse3")))
+static void canvas_pack_rgb_ssse3(const uint32_t *pixels, size_t count, uint8_t *rgb) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 6 <= count; i += 4) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(pixels + i));
+        _mm_storeu_si128((__m128i *)(rgb + 3*i), _mm_shuffle_epi8(c, shuffle));
+    }
+    canvas_pack_rgb_scalar(pixels + i, count - i, rgb + 3*i);
+}
+#endif // SPHERE_KERNEL_X86
+
+void canvas_pack_rgb(const uint32_t *pixels, size_t count, uint8_t *rgb) {
+#ifdef SPHERE_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        canvas_pack_rgb_ssse3(pixels, count, rgb);
+        return;
+    }
+#endif
+    canvas_pack_rgb_scalar(pixels, count, rgb);
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+#define scene_file_align(n) (((n) + SCENE_ALIGNMENT - 1) & ~(uint64_t)(SCENE_ALIGNMENT - 1))
+
+static SceneFileHeader scene_file_layout(const CompiledScene *scene) {
+    SceneFileHeader header = {
+        .magic = SCENE_FILE_MAGIC,
+        .version = SCENE_FILE_VERSION,
+        .header_size = sizeof(SceneFileHeader),
+        .light_size = sizeof(Light),
+        .node_size = sizeof(BvhNode),
+        .sphere_count = scene->spheres.count,
+        .sphere_stride = scene_align_count(scene->spheres.count),
+        .light_count = scene->lights.count,
+        .node_count = scene->bvh.count,
+        .leaf_count = scene->bvh.leaf_count,
+        .max_depth = scene->bvh.max_depth,
+    };
+    uint64_t offset = scene_file_align(sizeof(SceneFileHeader));
+    header.spheres_offset = offset;
+    if (header.sphere_stride > 0) offset += scene_align_count(6*header.sphere_stride + SCENE_PADDING)*sizeof(float);
+    header.colors_offset = offset;
+    offset = scene_file_align(offset + header.sphere_stride*sizeof(uint32_t));
+    header.lights_offset = offset;
+    offset = scene_file_align(offset + header.light_count*sizeof(Light));
+    header.nodes_offset = offset;
+    header.size = offset + header.node_count*sizeof(BvhNode);
+    return header;
+}
+
+// Stride and padding slots are written as zeros, so a scene always saves to
+// the same bytes
+bool save_compiled_scene(const CompiledScene *scene, const char *filepath) {
+    SceneFileHeader header = scene_file_layout(scene);
+    uint8_t *data = calloc(1, header.size);
+    assert(data != NULL && "Buy more RAM lol");
+    memcpy(data, &header, sizeof(header));
+    const SceneSpheres *spheres = &scene->spheres;
+    const float *arrays[] = { spheres->cx, spheres->cy, spheres->cz, spheres->radius2, spheres->specular, spheres->reflective };
+    for (size_t i = 0; i < sizeof(arrays)/sizeof(arrays[0]) && spheres->count > 0; i++) {
+        memcpy(data + header.spheres_offset + i*header.sphere_stride*sizeof(float), arrays[i], spheres->count*sizeof(float));
+    }
+    if (spheres->count > 0) memcpy(data + header.colors_offset, spheres->color, spheres->count*sizeof(uint32_t));
+    if (header.light_count > 0) memcpy(data + header.lights_offset, scene->lights.items, header.light_count*sizeof(Light));
+    if (header.node_count > 0) memcpy(data + header.nodes_offset, scene->bvh.nodes, header.node_count*sizeof(BvhNode));
+
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", filepath, strerror(errno));
+        free(data);
+        return false;
+    }
+    bool ok = write_all(fd, data, header.size);
+    if (!ok) fprintf(stderr, "ERROR: Could not write %s: %s\n", filepath, strerror(errno));
+    if (close(fd) != 0 && ok) {
+        fprintf(stderr, "ERROR: Could not close %s: %s\n", filepath, strerror(errno));
+        ok = false;
+    }
+    free(data);
+    return ok;
+}
+
+// The traversals index spheres and nodes straight from the nodes and keep a
+// BVH_MAX_DEPTH stack, so a mapped tree has to be one bvh_build could have
+// written: children after their parent, leaves inside the spheres, no node
+// visited twice and none deeper than the builder goes.
+static bool bvh_nodes_valid(const BvhNode *nodes, size_t node_count, size_t sphere_count) {
+    struct { uint32_t node, depth; } stack[BVH_MAX_DEPTH];
+    size_t sp = 0, visited = 0;
+    uint32_t node = 0, depth = 0;
+    if (node_count == 0) return true;
+    for (;;) {
+        if (++visited > node_count || depth >= BVH_MAX_DEPTH) return false;
+        const BvhNode *n = &nodes[node];
+        if (n->count > 0) {
+            if ((uint64_t)n->first + n->count > sphere_count) return false;
+        } else {
+            if (n->first <= node + 1 || n->first >= node_count) return false;
+            stack[sp].node = n->first;
+            stack[sp].depth = depth + 1;
+            sp += 1;
+            node += 1;
+            depth += 1;
+            continue;
+        }
+        if (sp == 0) break;
+        sp -= 1;
+        node = stack[sp].node;
+        depth = stack[sp].depth;
+    }
+    return visited == node_count;
+}
+
+// Checks the header against the layout this build would write, then the
+// light types and the BVH nodes, and maps the file read-only. Sphere data is
+// not read until rendering touches it.
+bool map_compiled_scene(CompiledScene *scene, const char *filepath) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Could not stat %s: %s\n", filepath, strerror(errno));
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *mapping = size >= sizeof(SceneFileHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    int error = errno;
+    close(fd);
+    if (size < sizeof(SceneFileHeader)) {
+        fprintf(stderr, "ERROR: %s is too small to be a compiled scene\n", filepath);
+        return false;
+    }
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map %s: %s\n", filepath, strerror(error));
+        return false;
+    }
+
+    const SceneFileHeader *header = mapping;
+    if (memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not a compiled scene\n", filepath);
+        goto fail;
+    }
+    if (header->version != SCENE_FILE_VERSION) {
+        fprintf(stderr, "ERROR: %s is compiled scene version %u, expected %u\n", filepath, header->version, SCENE_FILE_VERSION);
+        goto fail;
+    }
+    if (header->header_size != sizeof(SceneFileHeader) || header->light_size != sizeof(Light) || header->node_size != sizeof(BvhNode)) {
+        fprintf(stderr, "ERROR: %s was compiled by a build with a different scene layout\n", filepath);
+        goto fail;
+    }
+    // Recomputing the layout from the counts checks every offset at once
+    CompiledScene counts = {
+        .spheres.count = header->sphere_count,
+        .lights.count = header->light_count,
+        .bvh = { .count = header->node_count, .leaf_count = header->leaf_count, .max_depth = header->max_depth },
+    };
+    SceneFileHeader expected = scene_file_layout(&counts);
+    if (header->sphere_count > UINT32_MAX || header->node_count > 2*header->sphere_count
+        || memcmp(header, &expected, sizeof(expected)) != 0 || header->size != size) {
+        fprintf(stderr, "ERROR: %s is truncated or corrupted\n", filepath);
+        goto fail;
+    }
+
+    uint8_t *base = mapping;
+    const Light *lights = (const Light *)(base + header->lights_offset);
+    for (size_t i = 0; i < header->light_count; i++) {
+        if (lights[i].type < LIGHT_TYPE_AMBIENT || lights[i].type > LIGHT_TYPE_DIRECTIONAL) {
+            fprintf(stderr, "ERROR: %s is truncated or corrupted\n", filepath);
+            goto fail;
+        }
+    }
+    if (!bvh_nodes_valid((const BvhNode *)(base + header->nodes_offset), header->node_count, header->sphere_count)) {
+        fprintf(stderr, "ERROR: %s has a corrupted BVH\n", filepath);
+        goto fail;
+    }
+    size_t stride = header->sphere_stride;
+    float *floats = stride > 0 ? (float *)(base + header->spheres_offset) : NULL;
+    *scene = (CompiledScene){
+        .spheres = {
+            .cx = floats,
+            .cy = floats ? floats + 1*stride : NULL,
+            .cz = floats ? floats + 2*stride : NULL,
+            .radius2 = floats ? floats + 3*stride : NULL,
+            .specular = floats ? floats + 4*stride : NULL,
+            .reflective = floats ? floats + 5*stride : NULL,
+            .color = stride > 0 ? (uint32_t *)(base + header->colors_offset) : NULL,
+            .count = header->sphere_count,
+        },
+        .lights = {
+            .items = header->light_count > 0 ? (Light *)(base + header->lights_offset) : NULL,
+            .count = header->light_count,
+        },
+        .bvh = {
+            .nodes = header->node_count > 0 ? (BvhNode *)(base + header->nodes_offset) : NULL,
+            .count = header->node_count,
+            .leaf_count = header->leaf_count,
+            .max_depth = header->max_depth,
+        },
+        .limits = {
+            .max_depth = TRACE_MAX_DEPTH,
+            .ray_budget = TRACE_RAY_BUDGET,
+            .roulette = TRACE_ROULETTE,
+        },
+        .mapping = mapping,
+        .mapping_size = size,
+    };
+    scene->arena.block_size = header->light_count*4*sizeof(float) + SCENE_ALIGNMENT;
+    scene_lights_prepare(&scene->lights, &scene->arena);
+    return true;
+
+fail:
+    munmap(mapping, size);
+    return false;
+}
+
+static int ppm_header(char *header, size_t size, int width, int height) {
+    return snprintf(header, size, "P6\n%d %d\n255\n", width, height);
+}
+
+bool canvas_to_ppm_file(Canvas *canvas, const char *filepath) {
+    char header[64];
+    size_t header_size = (size_t)ppm_header(header, sizeof(header), canvas->width, canvas->height);
+    size_t count = (size_t)canvas->width*canvas->height;
+    Arena *scratch = arena_scratch();
+    ArenaMark mark = arena_mark(scratch);
+    uint8_t *data = arena_alloc(scratch, header_size + 3*count, SCENE_ALIGNMENT);
+    memcpy(data, header, header_size);
+    size_t stride = canvas_stride(canvas);
+    if (stride == (size_t)canvas->width) {
+        canvas_pack_rgb(canvas->pixels, count, data + header_size);
+    } else {
+        for (int y = 0; y < canvas->height; y++) {
+            canvas_pack_rgb(canvas->pixels + y*stride, canvas->width, data + header_size + (size_t)3*y*canvas->width);
+        }
+    }
+
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", filepath, strerror(errno));
+        arena_rewind(scratch, mark);
+        return false;
+    }
+    bool ok = write_all(fd, data, header_size + 3*count);
+    if (!ok) fprintf(stderr, "ERROR: Could not write %s: %s\n", filepath, strerror(errno));
+    if (close(fd) != 0 && ok) {
+        fprintf(stderr, "ERROR: Could not close %s: %s\n", filepath, strerror(errno));
+        ok = false;
+    }
+    arena_rewind(scratch, mark);
+    return ok;
+}
+
+static bool ppm_skip_space(const uint8_t **p, const uint8_t *end) {
+    while (*p < end) {
+        if (**p == '#') {
+            while (*p < end && **p != '\n') *p += 1;
+        } else if (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') {
+            *p += 1;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ppm_parse_int(const uint8_t **p, const uint8_t *end, int *value) {
+    if (!ppm_skip_space(p, end) || **p < '0' || **p > '9') return false;
+    long v = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        v = v*10 + (**p - '0');
+        if (v > 1<<16) return false;
+        *p += 1;
+    }
+    *value = (int)v;
+    return true;
+}
+
+// Reads the binary P6 files canvas_to_ppm_file writes, allocating canvas->pixels
+bool canvas_from_ppm_file(Canvas *canvas, const char *filepath) {
+    FILE *f = fopen(filepath, "rb");
     if (f == NULL) {
-        fprintf(stderr, "ERROR: Could not open out.ppm\n");
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    bool ok = data != NULL && fread(data, 1, size, f) == (size_t)size;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "ERROR: Could not read %s\n", filepath);
+        free(data);
+        return false;
+    }
+
+    const uint8_t *p = data, *end = data + size;
+    int width = 0, height = 0, max_value = 0;
+    ok = size >= 2 && p[0] == 'P' && p[1] == '6';
+    p += 2;
+    ok = ok && ppm_parse_int(&p, end, &width) && ppm_parse_int(&p, end, &height) && ppm_parse_int(&p, end, &max_value);
+    // Exactly one whitespace byte separates the header from the pixels
+    ok = ok && max_value == 255 && width > 0 && height > 0 && p < end;
+    p += 1;
+    size_t count = (size_t)width*height;
+    if (!ok || (size_t)(end - p) < 3*count) {
+        fprintf(stderr, "ERROR: %s is not a 255 P6 PPM\n", filepath);
+        free(data);
+        return false;
+    }
+
+    canvas->width = width;
+    canvas->height = height;
+    canvas->stride = width;
+    canvas->pixels = malloc(count*sizeof(uint32_t));
+    assert(canvas->pixels != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < count; i++) {
+        canvas->pixels[i] = to_c((uint32_t)p[3*i + 0], (uint32_t)p[3*i + 1], (uint32_t)p[3*i + 2]);
+    }
+    free(data);
+    return true;
+}
+
+// heatmap may be NULL, otherwise it must be the same size: unchanged pixels
+// show a dimmed expected image, changed ones go from red to yellow with error
+CanvasDiff canvas_diff(const Canvas *expected, const Canvas *actual, Canvas *heatmap) {
+    assert(expected->width == actual->width && expected->height == actual->height);
+    CanvasDiff diff = {0};
+    double squared = 0;
+    size_t count = (size_t)expected->width*expected->height;
+    for (int y = 0; y < expected->height; y++) {
+        const uint32_t *expected_row = expected->pixels + y*canvas_stride(expected);
+        const uint32_t *actual_row = actual->pixels + y*canvas_stride(actual);
+        uint32_t *heatmap_row = heatmap ? heatmap->pixels + y*canvas_stride(heatmap) : NULL;
+        for (int x = 0; x < expected->width; x++) {
+            uint32_t a = expected_row[x], b = actual_row[x];
+            int dr = abs((int)color_r(a) - (int)color_r(b));
+            int dg = abs((int)color_g(a) - (int)color_g(b));
+            int db = abs((int)color_b(a) - (int)color_b(b));
+            int error = dr > dg ? dr : dg;
+            if (db > error) error = db;
+            squared += dr*dr + dg*dg + db*db;
+            if (error > diff.max_error) diff.max_error = error;
+            if (error > 0) diff.differing += 1;
+
+            if (heatmap_row != NULL) {
+                if (error == 0) {
+                    uint32_t luma = (color_r(a)*54 + color_g(a)*183 + color_b(a)*19) >> 10;
+                    heatmap_row[x] = to_c(luma, luma, luma);
+                } else {
+                    // Even a 1/255 error is clearly visible
+                    uint32_t green = (uint32_t)clamp_color(error*4);
+                    heatmap_row[x] = to_c(255u, green, 0u);
+                }
+            }
+        }
+    }
+    double mse = squared/(3.0*count);
+    diff.psnr = mse > 0 ? 10*log10(255.0*255.0/mse) : INFINITY;
+    return diff;
+}
+
+bool ppm_stream_open(PpmStream *stream, const char *filepath, int width, int height) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (stream->fd < 0) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    stream->width = width;
+    stream->height = height;
+    stream->pending = malloc(height*sizeof(*stream->pending));
+    stream->buffer = malloc((size_t)3*width*PPM_STREAM_ROWS);
+    assert(stream->pending != NULL && stream->buffer != NULL && "Buy more RAM lol");
+    // Like PutPixel, tiles only cover the even part of odd sizes
+    for (int row = 0; row < height; row++) {
+        stream->pending[row] = row < height/2*2 ? width/2*2 : 0;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+
+    char header[64];
+    int header_size = ppm_header(header, sizeof(header), width, height);
+    if (!write_all(stream->fd, (const uint8_t *)header, header_size)) {
+        fprintf(stderr, "ERROR: Could not write %s: %s\n", filepath, strerror(errno));
+        stream->failed = true;
+    }
+    return true;
+}
+
+// Safe to call from render workers; the tile's pixels must be final
+void ppm_stream_tile_done(PpmStream *stream, const Canvas *canvas, Tile tile) {
+    pthread_mutex_lock(&stream->lock);
+    // Canvas rows run top to bottom while tile y grows upwards, see PutPixel
+    for (int y = tile.y0; y < tile.y1; y++) {
+        stream->pending[canvas->height/2 - y - 1] -= tile.x1 - tile.x0;
+    }
+    while (!stream->failed && stream->next_row < stream->height && stream->pending[stream->next_row] == 0) {
+        int rows = 0;
+        while (rows < PPM_STREAM_ROWS && stream->next_row + rows < stream->height && stream->pending[stream->next_row + rows] == 0) {
+            rows += 1;
+        }
+        size_t count = (size_t)rows*stream->width;
+        for (int r = 0; r < rows; r++) {
+            const uint32_t *row = canvas->pixels + (size_t)(stream->next_row + r)*canvas_stride(canvas);
+            canvas_pack_rgb(row, stream->width, stream->buffer + (size_t)3*r*stream->width);
+        }
+        if (!write_all(stream->fd, stream->buffer, 3*count)) {
+            fprintf(stderr, "ERROR: Could not write PPM rows: %s\n", strerror(errno));
+            stream->failed = true;
+        }
+        stream->next_row += rows;
+    }
+    pthread_mutex_unlock(&stream->lock);
+}
+
+bool ppm_stream_close(PpmStream *stream) {
+    bool ok = !stream->failed;
+    if (ok && stream->next_row < stream->height) {
+        fprintf(stderr, "ERROR: PPM stream closed after %d of %d rows\n", stream->next_row, stream->height);
+        ok = false;
+    }
+    if (close(stream->fd) != 0 && ok) {
+        fprintf(stderr, "ERROR: Could not close PPM stream: %s\n", strerror(errno));
+        ok = false;
+    }
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->buffer);
+    free(stream->pending);
+    return ok;
+}
+
+// Tiles are in the same centered coordinates as PutPixel, with x1/y1 exclusive
+void render_tile(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile) {
+    for (int y = tile.y0; y < tile.y1; y += RENDER_PACKET_SIZE) {
+        for (int x = tile.x0; x < tile.x1; x += RENDER_PACKET_SIZE) {
+            Tile block = {
+                .x0 = x, .y0 = y,
+                .x1 = x + RENDER_PACKET_SIZE < tile.x1 ? x + RENDER_PACKET_SIZE : tile.x1,
+                .y1 = y + RENDER_PACKET_SIZE < tile.y1 ? y + RENDER_PACKET_SIZE : tile.y1,
+            };
+            trace_packet(canvas, scene, camera, v, distance, block, NULL);
+        }
+    }
+}
+
+// Traces the tile's pixels on a step x step grid and replicates each sample
+// over its block. Samples already on the previous_step grid are kept, so
+// passes at 8, 4, 2, 1 trace every pixel exactly once.
+void render_tile_pass(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int step, int previous_step) {
+    if (step <= 1 && previous_step == 0) {
+        render_tile(canvas, scene, camera, v, distance, tile);
         return;
     }
 
-    fprintf(f, "P6\n");
-    fprintf(f, "%d %d\n", canvas->width, canvas->height);
-    fprintf(f, "255\n");
-    for (int y = 0; y < canvas->height; y++) {
-        for (int x = 0; x < canvas->width; x++) {
-            uint32_t c = canvas->pixels[y*canvas->width+x];
-            fputc(color_r(c), f);
-            fputc(color_g(c), f);
-            fputc(color_b(c), f);
+    for (int y = tile.y0; y < tile.y1; y += step) {
+        for (int x = tile.x0; x < tile.x1; x += step) {
+            if (previous_step > 0 && (x - tile.x0)%previous_step == 0 && (y - tile.y0)%previous_step == 0) continue;
+
+            Vector3 direction = canvas_to_viewport(canvas, v.x, v.y, distance, x, y);
+            RayBudget budget = ray_budget_pixel(scene, x, y, 0);
+            Vector3 radiance = trace_pixel(canvas, scene, camera, direction, x, y, &budget);
+            int x1 = x + step < tile.x1 ? x + step : tile.x1;
+            int y1 = y + step < tile.y1 ? y + step : tile.y1;
+            for (int by = y; by < y1; by++) {
+                for (int bx = x; bx < x1; bx++) {
+                    PutRadiance(canvas, bx, by, radiance, 1);
+                    // Only the traced pixel knows its hit, the copies wait for a finer pass
+                    if (bx != x || by != y) PutHit(canvas, bx, by, (PixelHit){ .t = INFINITY, .sphere = PIXEL_HIT_UNKNOWN });
+                }
+            }
+        }
+    }
+}
+
+// Averages a samples x samples grid of rays centered on every pixel
+void render_tile_supersampled(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int samples) {
+    render_tile_sampled(canvas, scene, camera, v, distance, tile, samples, SAMPLE_GRID, NULL);
+}
+
+// Averages samples x samples rays over every pixel, or only over the pixels
+// set in mask (one byte per canvas pixel) leaving the others as they are.
+// Jitter comes from the sample's own random stream, so it is the same on
+// every run and every tiling.
+void render_tile_sampled(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int samples, SamplePattern pattern, const uint8_t *mask) {
+    if (samples <= 1 && mask == NULL) {
+        render_tile(canvas, scene, camera, v, distance, tile);
+        return;
+    }
+
+    for (int y = tile.y0; y < tile.y1; y++) {
+        size_t row = (size_t)(canvas->height/2 - y - 1)*canvas_stride(canvas) + canvas->width/2;
+        for (int x = tile.x0; x < tile.x1; x++) {
+            if (mask && !mask[row + x]) continue;
+            Vector3 sum = {0};
+            for (int sy = 0; sy < samples; sy++) {
+                for (int sx = 0; sx < samples; sx++) {
+                    RayBudget budget = ray_budget_pixel(scene, x, y, sy*samples + sx);
+                    float jx = 0.5f, jy = 0.5f;
+                    if (pattern == SAMPLE_JITTER) {
+                        jx = ray_budget_random(&budget);
+                        jy = ray_budget_random(&budget);
+                    }
+                    float px = x + (sx + jx)/samples - 0.5f;
+                    float py = y + (sy + jy)/samples - 0.5f;
+                    Vector3 direction = canvas_to_viewport(canvas, v.x, v.y, distance, px, py);
+                    sum = Vector3Add(sum, trace_ray(scene, camera, direction, 1, T_MAX, &budget));
+                }
+            }
+            PutRadiance(canvas, x, y, sum, samples*samples);
+        }
+    }
+}
+
+// Adds one jittered ray per pixel to the tile's running sums. Sample 0 is the
+// pixel center every pass renders, so accumulation starts at 1.
+void render_tile_accumulate(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, int sample) {
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            RayBudget budget = ray_budget_pixel(scene, x, y, sample);
+            float px = x + ray_budget_random(&budget) - 0.5f;
+            float py = y + ray_budget_random(&budget) - 0.5f;
+            Vector3 direction = canvas_to_viewport(canvas, v.x, v.y, distance, px, py);
+            AddRadiance(canvas, x, y, trace_ray(scene, camera, direction, 1, T_MAX, &budget), 1);
+        }
+    }
+}
+
+// Traces the centers of the pixels set in mask, laid out like the canvas rows,
+// and records their hits. Blocks that are entirely set go through trace_packet.
+void render_tile_retrace(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, Tile tile, const uint8_t *mask) {
+    size_t stride = canvas_stride(canvas);
+    for (int by = tile.y0; by < tile.y1; by += RENDER_PACKET_SIZE) {
+        for (int bx = tile.x0; bx < tile.x1; bx += RENDER_PACKET_SIZE) {
+            Tile block = {
+                .x0 = bx, .y0 = by,
+                .x1 = bx + RENDER_PACKET_SIZE < tile.x1 ? bx + RENDER_PACKET_SIZE : tile.x1,
+                .y1 = by + RENDER_PACKET_SIZE < tile.y1 ? by + RENDER_PACKET_SIZE : tile.y1,
+            };
+            int set = 0;
+            for (int y = block.y0; y < block.y1; y++) {
+                const uint8_t *row = mask + (size_t)(canvas->height/2 - y - 1)*stride + canvas->width/2;
+                for (int x = block.x0; x < block.x1; x++) set += row[x];
+            }
+            if (set == 0) continue;
+            if (set == (block.x1 - block.x0)*(block.y1 - block.y0)) {
+                trace_packet(canvas, scene, camera, v, distance, block, NULL);
+                continue;
+            }
+
+            for (int y = block.y0; y < block.y1; y++) {
+                const uint8_t *row = mask + (size_t)(canvas->height/2 - y - 1)*stride + canvas->width/2;
+                for (int x = block.x0; x < block.x1; x++) {
+                    if (!row[x]) continue;
+                    Vector3 direction = canvas_to_viewport(canvas, v.x, v.y, distance, x, y);
+                    RayBudget budget = ray_budget_pixel(scene, x, y, 0);
+                    PutRadiance(canvas, x, y, trace_pixel(canvas, scene, camera, direction, x, y, &budget), 1);
+                }
+            }
+        }
+    }
+}
+
+static inline float sample_channel(const float *p, int c) {
+    return p[3] > 0 ? Clamp(p[c]/p[3], 0, 1) : 0;
+}
+
+// Marks the tile's pixels that differ from any of their 4 neighbours by more
+// than threshold. Only reads radiance, so tiles can run side by side. The
+// mask is laid out like the canvas rows, stride included.
+static void sample_classify_tile(const Canvas *canvas, Tile tile, float threshold, uint8_t *mask) {
+    int w = canvas->width, h = canvas->height;
+    size_t stride = canvas_stride(canvas);
+    for (int y = tile.y0; y < tile.y1; y++) {
+        int row = h/2 - y - 1;
+        for (int x = tile.x0; x < tile.x1; x++) {
+            int col = w/2 + x;
+            size_t i = (size_t)row*stride + col;
+            const float *p = &canvas->radiance[4*i];
+            int neighbours[4][2] = {{row, col - 1}, {row, col + 1}, {row - 1, col}, {row + 1, col}};
+            bool edge = false;
+            for (int n = 0; n < 4 && !edge; n++) {
+                int r = neighbours[n][0], c = neighbours[n][1];
+                // Odd sized canvases leave their last row and column unrendered
+                if (r < 0 || r >= 2*(h/2) || c < 0 || c >= 2*(w/2)) continue;
+                const float *q = &canvas->radiance[4*((size_t)r*stride + c)];
+                for (int k = 0; k < 3; k++) {
+                    if (fabsf(sample_channel(p, k) - sample_channel(q, k)) > threshold) edge = true;
+                }
+            }
+            mask[i] = edge;
+        }
+    }
+}
+
+void render_scene(Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance) {
+    assert(canvas->radiance != NULL && "Render into a canvas from canvas_alloc");
+    Tile tile = {
+        .x0 = -canvas->width/2, .y0 = -canvas->height/2,
+        .x1 = canvas->width/2, .y1 = canvas->height/2,
+    };
+    render_tile(canvas, scene, camera, v, distance, tile);
+    canvas_quantize(canvas, tile);
+}
+
+// Every worker owns a slice [begin, end) of the frame's tile array. The owner
+// pops from the back, idle workers steal from the front of someone else's slice.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} TileDeque;
+
+typedef struct {
+    Canvas *canvas;
+    CompiledScene *scene;
+    Vector3 camera;
+    Vector2 v;
+    float distance;
+    int step;
+    int previous_step;
+    int samples;
+    SamplePattern pattern;
+    int accumulate;         // Sample index to add to the canvas, 0 renders over it
+    uint8_t *mask;          // Pixels to refine, written instead of rendering when classify > 0
+    float classify;
+    ReprojectPhase reproject;
+    const Canvas *previous; // Frame that is being reprojected
+    _Atomic uint64_t *splat;    // Per pixel, t bits << 32 | previous pixel of the nearest hit landing there
+    _Atomic uint64_t *counts;   // Traced and invalidated pixels, added once per tile
+    const atomic_bool *cancel;
+    PpmStream *stream;
+    const ToneMap *tone;    // Resolve the frame instead of rendering it
+} RenderJob;
+
+typedef struct {
+    RenderPool *pool;
+    size_t id;
+} RenderWorker;
+
+#define SPLAT_EMPTY UINT64_MAX
+
+static inline uint32_t reproject_max_age(int x, int y) {
+    uint32_t block = (uint32_t)(x + 0x4000)/RENDER_PACKET_SIZE*0x9E3779B1u ^ (uint32_t)(y + 0x4000)/RENDER_PACKET_SIZE*0x85EBCA77u;
+    return REPROJECT_MAX_AGE - ((block >> 16) & (REPROJECT_MAX_AGE/2 - 1));
+}
+
+static inline bool reproject_background(const Canvas *canvas, int x, int y) {
+    int w = canvas->width, h = canvas->height;
+    for (int ny = y - 1; ny <= y + 1; ny++) {
+        for (int nx = x - 1; nx <= x + 1; nx++) {
+            if (nx < -w/2 || nx >= w/2 || ny < -h/2 || ny >= h/2) continue;
+            if (canvas->hits[(size_t)(h/2 - ny - 1)*canvas_stride(canvas) + w/2 + nx].sphere != PIXEL_HIT_NONE) return false;
+        }
+    }
+    return true;
+}
+
+// t >= 1 is positive, so its bits order like the float and the nearest hit
+// has the smallest key. Ties go to the lower pixel, which keeps it deterministic.
+static inline void splat_min(_Atomic uint64_t *slot, uint64_t key) {
+    uint64_t old = atomic_load_explicit(slot, memory_order_relaxed);
+    while (key < old && !atomic_compare_exchange_weak_explicit(slot, &old, key, memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+static inline uint64_t splat_key(float t, size_t pixel) {
+    uint32_t bits;
+    memcpy(&bits, &t, sizeof(bits));
+    return (uint64_t)bits << 32 | (uint32_t)pixel;
+}
+
+static inline float splat_t(uint64_t key) {
+    uint32_t bits = (uint32_t)(key >> 32);
+    float t;
+    memcpy(&t, &bits, sizeof(t));
+    return t;
+}
+
+// Moves the hits of the tile's pixels in job->previous to where they land from
+// job->camera. Tiles of the source frame land anywhere, hence the atomics.
+static void reproject_splat_tile(const RenderJob *job, Tile tile) {
+    const Canvas *previous = job->previous;
+    const SceneSpheres *spheres = &job->scene->spheres;
+    int w = previous->width, h = previous->height;
+    size_t stride = canvas_stride(previous);
+    uint64_t invalidated = 0;
+    for (int y = tile.y0; y < tile.y1; y++) {
+        size_t row = (size_t)(h/2 - y - 1)*stride + w/2;
+        for (int x = tile.x0; x < tile.x1; x++) {
+            const PixelHit *hit = &previous->hits[row + x];
+            if (hit->sphere == PIXEL_HIT_UNKNOWN) continue;
+            if (hit->age >= reproject_max_age(x, y) || (hit->sphere != PIXEL_HIT_NONE && spheres->reflective[hit->sphere] > 0)) {
+                invalidated += 1;
+                continue;
+            }
+            // The background stays put, reproject_resolve_tile takes it over
+            if (hit->sphere == PIXEL_HIT_NONE) continue;
+
+            // The sphere and normal give the exact point, so it does not drift
+            // from frame to frame like going through the pixel center would.
+            // t reaches it along a ray whose z is distance, like every
+            // canvas_to_viewport direction.
+            size_t sphere = hit->sphere;
+            Vector3 center = {spheres->cx[sphere], spheres->cy[sphere], spheres->cz[sphere]};
+            Vector3 P = Vector3Add(center, Vector3Scale(hit->normal, sqrtf(spheres->radius2[sphere])));
+            Vector3 Q = Vector3Subtract(P, job->camera);
+            float t = Q.z/job->distance;
+            if (t < 1) continue;
+            float facing = -Vector3DotProduct(hit->normal, Q);
+            if (facing < 0 || facing*facing < REPROJECT_MIN_COSINE*REPROJECT_MIN_COSINE*Vector3DotProduct(Q, Q)) {
+                invalidated += 1;
+                continue;
+            }
+            int nx = (int)floorf(Q.x/t*w/job->v.x + 0.5f);
+            int ny = (int)floorf(Q.y/t*h/job->v.y + 0.5f);
+            if (nx < -w/2 || nx >= w/2 || ny < -h/2 || ny >= h/2) continue;
+            splat_min(&job->splat[(size_t)(h/2 - ny - 1)*stride + w/2 + nx], splat_key(t, row + x));
+        }
+    }
+    if (invalidated) atomic_fetch_add_explicit(&job->counts[1], invalidated, memory_order_relaxed);
+}
+
+// Sphere of what landed on a pixel, PIXEL_HIT_UNKNOWN if nothing did
+static inline uint32_t splat_sphere(const RenderJob *job, uint64_t key) {
+    return key == SPLAT_EMPTY ? PIXEL_HIT_UNKNOWN : job->previous->hits[(uint32_t)key].sphere;
+}
+
+// Takes over what landed on each of the tile's pixels and traces the ones
+// nothing valid landed on, or that sit next to a nearer surface they may be
+// peeking through. Only the splat is read across tiles.
+static void reproject_resolve_tile(const RenderJob *job, Tile tile) {
+    Canvas *canvas = job->canvas;
+    const Canvas *previous = job->previous;
+    int w = canvas->width, h = canvas->height;
+    size_t stride = canvas_stride(canvas);
+    uint64_t traced = 0;
+    for (int y = tile.y0; y < tile.y1; y++) {
+        size_t row = (size_t)(h/2 - y - 1)*stride + w/2;
+        for (int x = tile.x0; x < tile.x1; x++) {
+            size_t i = row + x;
+            uint64_t key = atomic_load_explicit(&job->splat[i], memory_order_relaxed);
+            // Infinitely far, so anything that landed here is in front of it
+            if (key == SPLAT_EMPTY && previous->hits[i].sphere == PIXEL_HIT_NONE &&
+                previous->hits[i].age < reproject_max_age(x, y) && reproject_background(previous, x, y)) {
+                key = splat_key(INFINITY, i);
+            }
+            bool trace = key == SPLAT_EMPTY;
+            if (!trace) {
+                const PixelHit *source = &previous->hits[(uint32_t)key];
+                float t = splat_t(key);
+                canvas->hits[i] = (PixelHit){ .t = t, .sphere = source->sphere, .normal = source->normal, .age = source->age + 1 };
+                memcpy(&canvas->radiance[4*i], &previous->radiance[4*(size_t)(uint32_t)key], 4*sizeof(float));
+
+                // Rows go down the buffer as y goes up
+                size_t neighbours[4] = {i - 1, i + 1, i + stride, i - stride};
+                bool inside[4] = {x > -w/2, x + 1 < w/2, y > -h/2, y + 1 < h/2};
+                float nearer = t*(1 - REPROJECT_DEPTH_SLACK);
+                for (int n = 0; n < 4 && !trace; n++) {
+                    if (!inside[n]) continue;
+                    uint64_t other = atomic_load_explicit(&job->splat[neighbours[n]], memory_order_relaxed);
+                    if (other != SPLAT_EMPTY && splat_t(other) < nearer && splat_sphere(job, other) != source->sphere) trace = true;
+                }
+            } else {
+                canvas->hits[i] = (PixelHit){ .t = INFINITY, .sphere = PIXEL_HIT_UNKNOWN };
+            }
+            job->mask[i] = trace;
+            traced += trace;
+        }
+    }
+    if (traced) atomic_fetch_add_explicit(&job->counts[0], traced, memory_order_relaxed);
+    render_tile_retrace(canvas, job->scene, job->camera, job->v, job->distance, tile, job->mask);
+}
+
+struct RenderPool {
+    pthread_t *threads;
+    RenderWorker *workers;
+    TileDeque *deques;
+    size_t thread_count;
+    int tile_size;
+
+    // Tiles and the adaptive mask live for one frame, see render_pool_frame
+    Arena frame;
+    Tile *tiles;
+    uint8_t *mask;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    uint64_t generation;
+    size_t active;
+    bool quit;
+
+    RenderJob job;
+};
+
+static bool tile_deque_pop(TileDeque *deque, Tile *tiles, Tile *tile) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        *tile = tiles[--deque->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool tile_deque_steal(TileDeque *deque, Tile *tiles, Tile *tile) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        *tile = tiles[deque->head++];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool render_pool_next_tile(RenderPool *pool, size_t id, Tile *tile) {
+    if (tile_deque_pop(&pool->deques[id], pool->tiles, tile)) return true;
+    for (size_t i = 1; i < pool->thread_count; i++) {
+        size_t victim = (id + i) % pool->thread_count;
+        if (tile_deque_steal(&pool->deques[victim], pool->tiles, tile)) return true;
+    }
+    return false;
+}
+
+static void *render_pool_worker(void *arg) {
+    RenderWorker *worker = arg;
+    RenderPool *pool = worker->pool;
+    uint64_t seen = 0;
+#ifdef GRAPHICS_TRACE
+    char name[32];
+    snprintf(name, sizeof(name), "render worker %zu", worker->id);
+    trace_thread_name(name);
+#endif
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            arena_free(arena_scratch());
+            return NULL;
+        }
+        seen = pool->generation;
+        RenderJob job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+        arena_reset(arena_scratch());
+
+        Tile tile;
+        while (render_pool_next_tile(pool, worker->id, &tile)) {
+            if (job.cancel && atomic_load_explicit(job.cancel, memory_order_relaxed)) break;
+            TRACE_BEGIN(tile_start);
+            if (job.tone) {
+                canvas_resolve_tile(job.canvas, *job.tone, tile);
+                TRACE_END(tile_start, "resolve");
+                continue;
+            }
+            if (job.classify > 0) {
+                sample_classify_tile(job.canvas, tile, job.classify, job.mask);
+                TRACE_END(tile_start, "classify");
+                continue;
+            }
+            if (job.reproject == REPROJECT_SPLAT) {
+                reproject_splat_tile(&job, tile);
+                TRACE_END(tile_start, "splat");
+                continue;
+            }
+            if (job.reproject == REPROJECT_RESOLVE) {
+                reproject_resolve_tile(&job, tile);
+            } else if (job.accumulate > 0) {
+                render_tile_accumulate(job.canvas, job.scene, job.camera, job.v, job.distance, tile, job.accumulate);
+            } else if (job.samples > 1) {
+                render_tile_sampled(job.canvas, job.scene, job.camera, job.v, job.distance, tile, job.samples, job.pattern, job.mask);
+            } else {
+                render_tile_pass(job.canvas, job.scene, job.camera, job.v, job.distance, tile, job.step, job.previous_step);
+            }
+            canvas_quantize(job.canvas, tile);
+            if (job.stream) ppm_stream_tile_done(job.stream, job.canvas, tile);
+            TRACE_END_ARG(tile_start, "tile", job.step);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active -= 1;
+        if (pool->active == 0) pthread_cond_signal(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+RenderPool *render_pool_create(int thread_count, int tile_size) {
+    if (thread_count <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = n > 0 ? (int)n : 1;
+    }
+    if (tile_size <= 0) tile_size = RENDER_TILE_SIZE;
+    // Whole cache lines of every canvas row, so no two workers write the same line
+    tile_size = (tile_size + CANVAS_ROW_ALIGN - 1) & ~(CANVAS_ROW_ALIGN - 1);
+
+    RenderPool *pool = calloc(1, sizeof(*pool));
+    assert(pool != NULL && "Buy more RAM lol");
+    pool->thread_count = thread_count;
+    pool->tile_size = tile_size;
+    pool->threads = calloc(thread_count, sizeof(*pool->threads));
+    pool->workers = calloc(thread_count, sizeof(*pool->workers));
+    pool->deques = calloc(thread_count, sizeof(*pool->deques));
+    assert(pool->threads != NULL && pool->workers != NULL && pool->deques != NULL && "Buy more RAM lol");
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i] = (RenderWorker){ .pool = pool, .id = i };
+        if (pthread_create(&pool->threads[i], NULL, render_pool_worker, &pool->workers[i]) != 0) {
+            fprintf(stderr, "ERROR: Could not create render thread %zu\n", i);
+            pool->thread_count = i;
+            break;
+        }
+    }
+
+    if (pool->thread_count == 0) {
+        render_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void render_pool_destroy(RenderPool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    arena_free(&pool->frame);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+// Starts a frame: whatever the previous one took from the frame arena is free
+static void render_pool_frame(RenderPool *pool) {
+    arena_reset(&pool->frame);
+}
+
+static bool render_pool_run(RenderPool *pool, RenderJob job) {
+    Canvas *canvas = job.canvas;
+    assert(canvas->radiance != NULL && "Render into a canvas from canvas_alloc");
+    int x_min = -canvas->width/2, x_max = canvas->width/2;
+    int y_min = -canvas->height/2, y_max = canvas->height/2;
+    if (x_min == x_max || y_min == y_max) return true;
+    // Resolving is one pass over memory, full width bands keep it sequential
+    int ts = pool->tile_size;
+    int tw = job.tone ? x_max - x_min : ts;
+    size_t tiles_x = (size_t)(x_max - x_min + tw - 1)/tw;
+    size_t tiles_y = (size_t)(y_max - y_min + ts - 1)/ts;
+    size_t count = tiles_x*tiles_y;
+
+    pool->tiles = arena_alloc_array(&pool->frame, Tile, count);
+
+    size_t n = 0;
+    for (int y = y_min; y < y_max; y += ts) {
+        for (int x = x_min; x < x_max; x += tw) {
+            pool->tiles[n++] = (Tile){
+                .x0 = x, .y0 = y,
+                .x1 = x + tw < x_max ? x + tw : x_max,
+                .y1 = y + ts < y_max ? y + ts : y_max,
+            };
         }
     }
+
+    // Workers start on neighbouring tiles so the first pass stays cache friendly
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pool->deques[i].head = count*i/pool->thread_count;
+        pool->deques[i].tail = count*(i + 1)/pool->thread_count;
+    }
+
+    TRACE_BEGIN(frame_start);
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->active = pool->thread_count;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    TRACE_END_ARG(frame_start, job.tone ? "canvas_resolve" : "render_scene", job.step);
+
+    return !(job.cancel && atomic_load(job.cancel));
+}
+
+bool render_scene_pass(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, int step, int previous_step, const atomic_bool *cancel) {
+    render_pool_frame(pool);
+    return render_pool_run(pool, (RenderJob){
+        .canvas = canvas,
+        .scene = scene,
+        .camera = view.camera,
+        .v = view.v,
+        .distance = view.distance,
+        .step = step,
+        .previous_step = previous_step,
+        .cancel = cancel,
+    });
+}
+
+bool render_scene_parallel(RenderPool *pool, Canvas *canvas, CompiledScene *scene, Vector3 camera, Vector2 v, float distance, const atomic_bool *cancel) {
+    return render_scene_pass(pool, canvas, scene, (RenderView){camera, v, distance}, 1, 0, cancel);
+}
+
+void render_scene_stream(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, PpmStream *stream) {
+    render_pool_frame(pool);
+    render_pool_run(pool, (RenderJob){
+        .canvas = canvas,
+        .scene = scene,
+        .camera = view.camera,
+        .v = view.v,
+        .distance = view.distance,
+        .step = 1,
+        .stream = stream,
+    });
+}
+
+void render_scene_supersampled(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, int samples) {
+    render_pool_frame(pool);
+    render_pool_run(pool, (RenderJob){
+        .canvas = canvas,
+        .scene = scene,
+        .camera = view.camera,
+        .v = view.v,
+        .distance = view.distance,
+        .step = 1,
+        .samples = samples,
+    });
+}
+
+// Rewrites every pixel from the radiance, in bands across the pool's threads
+// or on the calling thread when pool is NULL
+void canvas_resolve(RenderPool *pool, Canvas *canvas, ToneMap tone) {
+    assert(canvas->radiance != NULL && "Resolve a canvas from canvas_alloc");
+    if (pool == NULL) {
+        canvas_resolve_tile(canvas, tone, (Tile){
+            .x0 = -canvas->width/2, .y0 = -canvas->height/2,
+            .x1 = canvas->width/2, .y1 = canvas->height/2,
+        });
+        return;
+    }
+    render_pool_frame(pool);
+    render_pool_run(pool, (RenderJob){ .canvas = canvas, .tone = &tone });
 }
 
-void render_scene(Canvas *canvas, Scene *scene, Vector3 camera, Vector2 v, float distance) {
+void render_scene_sampled(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, SampleSettings sampling, SampleHistogram *histogram) {
+    int n = sampling.samples;
+    assert(1 <= n && n <= RENDER_MAX_SAMPLES);
+    RenderJob job = {
+        .canvas = canvas,
+        .scene = scene,
+        .camera = view.camera,
+        .v = view.v,
+        .distance = view.distance,
+        .step = 1,
+        .samples = n,
+        .pattern = sampling.pattern,
+    };
+
+    render_pool_frame(pool);
+    bool adaptive = sampling.adaptive > 0 && n > 1;
+    if (adaptive) {
+        pool->mask = arena_alloc(&pool->frame, canvas_stride(canvas)*canvas->height, SCENE_ALIGNMENT);
+        render_pool_run(pool, (RenderJob){ .canvas = canvas, .scene = scene, .camera = view.camera, .v = view.v, .distance = view.distance, .step = 1 });
+        render_pool_run(pool, (RenderJob){ .canvas = canvas, .mask = pool->mask, .classify = sampling.adaptive });
+        job.mask = pool->mask;
+    }
+    render_pool_run(pool, job);
+
+    if (histogram == NULL) return;
+    *histogram = (SampleHistogram){0};
+    uint64_t rendered = (uint64_t)(2*(canvas->width/2))*(2*(canvas->height/2));
+    if (!adaptive) {
+        histogram->pixels[n*n] = rendered;
+        histogram->samples = rendered*n*n;
+        return;
+    }
+    uint64_t refined = 0;
     for (int y = -canvas->height/2; y < canvas->height/2; y++) {
-        for (int x = -canvas->width/2; x < canvas->width/2; x++) {
-            Vector3 direction = canvas_to_viewport(canvas, v.x, v.y, distance, x, y);
-            uint32_t color = trace_ray(scene, camera, direction, 1, T_MAX);
-            PutPixel(canvas, x, y, color);
+        const uint8_t *row = pool->mask + (size_t)(canvas->height/2 - y - 1)*canvas_stride(canvas);
+        for (int x = 0; x < 2*(canvas->width/2); x++) refined += row[x];
+    }
+    // Refined pixels were traced once before their n x n samples
+    histogram->pixels[1] = rendered - refined;
+    histogram->pixels[n*n] = refined;
+    histogram->samples = rendered + refined*n*n;
+}
+
+// Adds one more sample to every pixel of a canvas that already holds a full
+// resolution pass of the same view. Returns false if cancel was raised.
+bool render_scene_accumulate(RenderPool *pool, Canvas *canvas, CompiledScene *scene, RenderView view, int sample, const atomic_bool *cancel) {
+    assert(sample > 0 && "Sample 0 is the pass being accumulated onto");
+    render_pool_frame(pool);
+    render_pool_run(pool, (RenderJob){
+        .canvas = canvas,
+        .scene = scene,
+        .camera = view.camera,
+        .v = view.v,
+        .distance = view.distance,
+        .step = 1,
+        .accumulate = sample,
+        .cancel = cancel,
+    });
+    return !(cancel && atomic_load(cancel));
+}
+
+// Renders to into canvas from previous, a frame of from: every hit of previous
+// is moved to the pixel it lands on from the new camera, nearest first, and
+// brings its radiance along. The background is infinitely far and stays put,
+// except next to a surface that may be uncovering something. Reflective
+// surfaces are always traced since what they mirror moves with the camera;
+// other shading is carried over as is, so highlights lag until a full pass.
+// Both canvases keep hits and both views share v and distance.
+bool render_scene_reproject(RenderPool *pool, Canvas *canvas, const Canvas *previous, CompiledScene *scene, RenderView from, RenderView to, ReprojectStats *stats, const atomic_bool *cancel) {
+    assert(canvas->hits != NULL && previous->hits != NULL && "Reproject canvases that keep hits");
+    assert(canvas->width == previous->width && canvas->height == previous->height);
+    assert(canvas_stride(canvas) == canvas_stride(previous));
+    assert(from.v.x == to.v.x && from.v.y == to.v.y && from.distance == to.distance && "Viewport changes need a full render");
+    size_t count = canvas_stride(canvas)*canvas->height;
+    assert(count <= UINT32_MAX && "Splat keys hold 32-bit pixel indices");
+
+    render_pool_frame(pool);
+    pool->mask = arena_alloc(&pool->frame, count, SCENE_ALIGNMENT);
+    _Atomic uint64_t *splat = arena_alloc(&pool->frame, count*sizeof(*splat), SCENE_ALIGNMENT);
+    memset(splat, 0xFF, count*sizeof(*splat));
+    _Atomic uint64_t counts[2];
+    atomic_init(&counts[0], 0);
+    atomic_init(&counts[1], 0);
+    RenderJob job = {
+        .canvas = canvas,
+        .scene = scene,
+        .camera = to.camera,
+        .v = to.v,
+        .distance = to.distance,
+        .step = 1,
+        .mask = pool->mask,
+        .reproject = REPROJECT_SPLAT,
+        .previous = previous,
+        .splat = splat,
+        .counts = counts,
+        .cancel = cancel,
+    };
+    bool complete = render_pool_run(pool, job);
+    if (complete) {
+        job.reproject = REPROJECT_RESOLVE;
+        complete = render_pool_run(pool, job);
+    }
+
+    if (stats) {
+        *stats = (ReprojectStats){
+            .frames = 1,
+            .pixels = (uint64_t)(2*(canvas->width/2))*(2*(canvas->height/2)),
+            .traced = atomic_load(&counts[0]),
+            .invalidated = atomic_load(&counts[1]),
+        };
+    }
+    return complete;
+}
+
+void sample_histogram_print(FILE *f, const SampleHistogram *histogram) {
+    uint64_t pixels = 0;
+    for (size_t i = 0; i < sizeof(histogram->pixels)/sizeof(histogram->pixels[0]); i++) pixels += histogram->pixels[i];
+    if (pixels == 0) return;
+    fprintf(f, "spp:");
+    for (size_t i = 0; i < sizeof(histogram->pixels)/sizeof(histogram->pixels[0]); i++) {
+        if (histogram->pixels[i] == 0) continue;
+        fprintf(f, " %zu: %llu (%.1f%%),", i, (unsigned long long)histogram->pixels[i], 100.0*histogram->pixels[i]/pixels);
+    }
+    fprintf(f, " average %.2f rays/pixel\n", (double)histogram->samples/pixels);
+}
+
+struct RenderAsync {
+    RenderPool *pool;
+    CompiledScene *scene;
+    Canvas *front;
+    Canvas back;
+    Canvas previous;        // Swapped with back to reproject from the last frame
+    RenderView hits_view;
+    bool has_hits;          // back holds the hits of hits_view at full resolution
+    double trace_seconds;   // Running averages of the coarse passes a move costs without hits
+    double reproject_seconds;   // and of a reprojection, 0 until one completed
+    int reproject_skipped;  // Moves traced since reprojecting measured slower
+    ReprojectStats reprojected;
+    uint32_t *present;
+    int present_samples;
+    int front_samples;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    RenderView view;
+    bool pending;
+    bool rendering;
+    bool ready;
+    bool quit;
+    atomic_bool cancel;
+};
+
+static void render_async_publish(RenderAsync *async, int samples) {
+    TRACE_BEGIN(publish_start);
+    pthread_mutex_lock(&async->lock);
+    memcpy(async->present, async->back.pixels, canvas_stride(&async->back)*async->back.height*sizeof(uint32_t));
+    async->present_samples = samples;
+    async->ready = true;
+    pthread_mutex_unlock(&async->lock);
+    TRACE_END(publish_start, "publish");
+}
+
+// Waits up to seconds for a request, true if none came and the view is idle.
+// Called with the lock not held.
+static bool render_async_idle(RenderAsync *async, double seconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    long ns = deadline.tv_nsec + (long)(seconds*1e9);
+    deadline.tv_sec += ns/1000000000;
+    deadline.tv_nsec = ns%1000000000;
+    pthread_mutex_lock(&async->lock);
+    while (!async->pending && !async->quit) {
+        if (pthread_cond_timedwait(&async->cond, &async->lock, &deadline) == ETIMEDOUT) break;
+    }
+    bool idle = !async->pending && !async->quit;
+    pthread_mutex_unlock(&async->lock);
+    return idle;
+}
+
+static double render_async_average(double average, double seconds) {
+    return average == 0 ? seconds : average + (seconds - average)/4;
+}
+
+static void *render_async_thread(void *arg) {
+    RenderAsync *async = arg;
+    TRACE_THREAD_NAME("render async");
+
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+        while (!async->quit && !async->pending) {
+            pthread_cond_wait(&async->cond, &async->lock);
+        }
+        if (async->quit) break;
+
+        RenderView view = async->view;
+        async->pending = false;
+        async->rendering = true;
+        atomic_store(&async->cancel, false);
+        pthread_mutex_unlock(&async->lock);
+
+        // Camera moves reuse the last frame's hits when that is faster than
+        // tracing them. A cancelled reprojection leaves the frame it read from
+        // untouched, so the next one starts from that again; a cancelled full
+        // pass after it leaves hits of view in every pixel. Viewport changes
+        // move every ray, so they start over from the coarse passes.
+        bool complete = true;
+        RenderView last = async->hits_view;
+        bool reproject = async->has_hits && view.v.x != 0 && view.v.y != 0 &&
+            view.v.x == last.v.x && view.v.y == last.v.y && view.distance == last.distance;
+        if (reproject && async->reproject_seconds >= async->trace_seconds && async->reproject_seconds > 0) {
+            reproject = ++async->reproject_skipped > REPROJECT_PROBE_INTERVAL;
+        }
+        if (reproject) {
+            Canvas back = async->previous;
+            async->previous = async->back;
+            async->back = back;
+            ReprojectStats stats;
+            double start = graphics_now();
+            complete = render_scene_reproject(async->pool, &async->back, &async->previous, async->scene, last, view, &stats, &async->cancel);
+            if (complete) {
+                async->reproject_seconds = render_async_average(async->reproject_seconds, graphics_now() - start);
+                async->reproject_skipped = 0;
+                async->hits_view = view;
+                pthread_mutex_lock(&async->lock);
+                async->reprojected.frames += stats.frames;
+                async->reprojected.pixels += stats.pixels;
+                async->reprojected.traced += stats.traced;
+                async->reprojected.invalidated += stats.invalidated;
+                pthread_mutex_unlock(&async->lock);
+                render_async_publish(async, 1);
+            } else {
+                async->back = async->previous;
+                async->previous = back;
+            }
+
+            // Settles the carried over shading once the camera has stopped,
+            // a request in the meantime goes straight to the next reprojection
+            complete = complete && render_async_idle(async, REPROJECT_SETTLE_DELAY);
+            if (complete) {
+                pthread_mutex_lock(&async->lock);
+                async->reprojected.settled += stats.pixels;
+                pthread_mutex_unlock(&async->lock);
+                complete = render_scene_pass(async->pool, &async->back, async->scene, view, 1, 0, &async->cancel);
+                if (complete) render_async_publish(async, 1);
+            }
+        } else {
+            // Each pass refines the back buffer in place and publishes a copy,
+            // so the caller can swap while the next pass is being traced
+            async->has_hits = false;
+            int previous_step = 0;
+            double seconds = 0;
+            for (int step = RENDER_PREVIEW_STEP; step >= 1; step /= 2) {
+                double start = graphics_now();
+                if (!render_scene_pass(async->pool, &async->back, async->scene, view, step, previous_step, &async->cancel)) {
+                    complete = false;
+                    break;
+                }
+                seconds += graphics_now() - start;
+                previous_step = step;
+                render_async_publish(async, 1);
+            }
+            if (complete) {
+                // The passes trace every pixel once between them
+                async->trace_seconds = render_async_average(async->trace_seconds, seconds);
+                async->has_hits = true;
+                async->hits_view = view;
+            }
+        }
+
+        // The full pass overwrote every pixel, so the radiance sums restart
+        // from it. Copies are rate limited: a sample can take well under a
+        // frame and the caller only needs to see the image converge.
+        double published = graphics_now();
+        for (int sample = 1; complete && sample < RENDER_ACCUMULATE_MAX; sample++) {
+            if (!render_scene_accumulate(async->pool, &async->back, async->scene, view, sample, &async->cancel)) break;
+            double now = graphics_now();
+            if (now - published >= 1.0/RENDER_ACCUMULATE_HZ || sample + 1 == RENDER_ACCUMULATE_MAX) {
+                render_async_publish(async, sample + 1);
+                published = now;
+            }
         }
+
+        pthread_mutex_lock(&async->lock);
+        async->rendering = false;
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+RenderAsync *render_async_create(RenderPool *pool, CompiledScene *scene, Canvas *front) {
+    RenderAsync *async = calloc(1, sizeof(*async));
+    assert(async != NULL && "Buy more RAM lol");
+    async->pool = pool;
+    async->scene = scene;
+    async->front = front;
+    async->back = canvas_alloc(front->width, front->height);
+    async->previous = canvas_alloc(front->width, front->height);
+    canvas_keep_hits(&async->back);
+    canvas_keep_hits(&async->previous);
+    assert(canvas_stride(front) == canvas_stride(&async->back) && "Render into a canvas from canvas_alloc");
+    size_t size = canvas_stride(front)*front->height*sizeof(uint32_t);
+    async->present = aligned_alloc(SCENE_ALIGNMENT, size);
+    assert(async->present != NULL && "Buy more RAM lol");
+    memset(async->present, 0, size);
+    pthread_mutex_init(&async->lock, NULL);
+    // render_async_idle waits against the monotonic clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&async->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    atomic_init(&async->cancel, false);
+
+    if (pthread_create(&async->thread, NULL, render_async_thread, async) != 0) {
+        fprintf(stderr, "ERROR: Could not create async render thread\n");
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->lock);
+        free(async->present);
+        canvas_free(&async->previous);
+        canvas_free(&async->back);
+        free(async);
+        return NULL;
+    }
+    return async;
+}
+
+void render_async_destroy(RenderAsync *async) {
+    if (async == NULL) return;
+
+    pthread_mutex_lock(&async->lock);
+    async->quit = true;
+    atomic_store(&async->cancel, true);
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+    pthread_join(async->thread, NULL);
+
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->lock);
+    free(async->present);
+    canvas_free(&async->previous);
+    canvas_free(&async->back);
+    free(async);
+}
+
+void render_async_request(RenderAsync *async, RenderView view) {
+    pthread_mutex_lock(&async->lock);
+    async->view = view;
+    async->pending = true;
+    if (async->rendering) atomic_store(&async->cancel, true);
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+}
+
+// Swaps a finished frame into front->pixels, returns false if none was ready
+bool render_async_swap(RenderAsync *async) {
+    TRACE_BEGIN(start);
+    pthread_mutex_lock(&async->lock);
+    bool swapped = async->ready;
+    if (swapped) {
+        uint32_t *pixels = async->front->pixels;
+        async->front->pixels = async->present;
+        async->present = pixels;
+        async->front_samples = async->present_samples;
+        async->ready = false;
     }
+    pthread_mutex_unlock(&async->lock);
+    TRACE_END(start, "swap");
+    return swapped;
+}
+
+// Samples per pixel in the frame last swapped into front
+int render_async_samples(RenderAsync *async) {
+    pthread_mutex_lock(&async->lock);
+    int samples = async->front_samples;
+    pthread_mutex_unlock(&async->lock);
+    return samples;
+}
+
+// Totals over every camera move that was reprojected instead of traced
+ReprojectStats render_async_reproject_stats(RenderAsync *async) {
+    pthread_mutex_lock(&async->lock);
+    ReprojectStats stats = async->reprojected;
+    pthread_mutex_unlock(&async->lock);
+    return stats;
+}
+
+// Share of the primary rays that tracing every move from scratch would have
+// cast and that were not, settle passes included. Negative when reprojecting
+// traced more than it saved.
+double reproject_rays_saved(const ReprojectStats *stats) {
+    if (stats->pixels == 0) return 0;
+    return ((double)stats->pixels - (double)stats->traced - (double)stats->settled)/stats->pixels;
 }
 
 #endif // GRAPHICS_IMPLEMENTATION
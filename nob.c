@@ -22,13 +22,40 @@ void add_raylib(Nob_Cmd *cmd) {
     nob_cmd_append(cmd, "-lm", "-ldl", "-lpthread");
 }
 
+// Extra -D flags on the nob command line go to every target,
+// e.g. ./nob -DGRAPHICS_STATS
+void add_defines(Nob_Cmd *cmd, int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-D", 2) == 0) nob_cmd_append(cmd, argv[i]);
+    }
+}
+
 int main(int argc, char **argv) {
     NOB_GO_REBUILD_URSELF(argc, argv);
     Nob_Cmd cmd = {0};
-    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-ggdb");
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-ggdb", "-O2");
     nob_cmd_append(&cmd, "-I.");
     nob_cmd_append(&cmd, "-o", "main");
     nob_cmd_append(&cmd, "graphics.c");
+    add_defines(&cmd, argc, argv);
+    add_raylib(&cmd);
+    if (!nob_cmd_run_sync(cmd)) return 1;
+
+    cmd.count = 0;
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-ggdb", "-O2");
+    nob_cmd_append(&cmd, "-I.");
+    nob_cmd_append(&cmd, "-o", "bench");
+    nob_cmd_append(&cmd, "bench.c");
+    add_defines(&cmd, argc, argv);
+    add_raylib(&cmd);
+    if (!nob_cmd_run_sync(cmd)) return 1;
+
+    cmd.count = 0;
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-ggdb", "-O2");
+    nob_cmd_append(&cmd, "-I.");
+    nob_cmd_append(&cmd, "-o", "test");
+    nob_cmd_append(&cmd, "test.c");
+    add_defines(&cmd, argc, argv);
     add_raylib(&cmd);
     if (!nob_cmd_run_sync(cmd)) return 1;
     return 0;
@@ -0,0 +1,511 @@
+// Canonical scenes shared by the renderer and the benchmarks.
+// Include after nob.h and graphics.h.
+#ifndef SCENES_H
+#define SCENES_H
+
+void scene_demo(Scene *scene);
+void scene_mirrors(Scene *scene);
+void scene_random(Scene *scene, size_t count, uint64_t seed);
+void scene_many_lights(Scene *scene, size_t count);
+bool scene_by_name(Scene *scene, const char *name);
+
+// Text scenes hold one directive per line, '#' starts a comment:
+//     sphere x y z radius r g b [specular [reflective]]
+//     ambient intensity
+//     point intensity x y z
+//     directional intensity x y z
+//     camera x y z
+//     viewport vw vh
+//     distance d
+// with r g b in 0..255. The view directives only update view, which may be
+// NULL. Errors are reported as path:line:column and leave scene as it was.
+bool scene_parse(Scene *scene, RenderView *view, const char *path, Nob_String_View source);
+bool scene_load_file(Scene *scene, RenderView *view, const char *path);
+bool scene_save_file(const Scene *scene, const RenderView *view, const char *path);
+
+#endif // SCENES_H
+
+#ifdef SCENES_IMPLEMENTATION
+
+void scene_demo(Scene *scene) {
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_SPHERE,
+        .obj = {
+            .sphere = (Sphere){
+                .radius = 1,
+                .center = (Vector3){0, -1, 3},
+                .color = to_c(255, 0, 0)
+            }
+        }
+    }));
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_SPHERE,
+        .obj = {
+            .sphere = (Sphere){
+                .radius = 1,
+                .center = (Vector3){-2, 0, 4},
+                .color = to_c(0, 255, 0)
+            }
+        }
+    }));
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_SPHERE,
+        .obj = {
+            .sphere = (Sphere){
+                .radius = 1,
+                .center = (Vector3){2, 0, 4},
+                .color = to_c(0, 0, 255)
+            }
+        }
+    }));
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_SPHERE,
+        .obj = {
+            .sphere = (Sphere){
+                .radius = 5000,
+                .center = (Vector3){0, -5001, 0},
+                .color = to_c(255, 255, 0)
+            }
+        }
+    }));
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = {
+            .light = (Light){
+                .type = LIGHT_TYPE_AMBIENT,
+                .intensity = 0.2,
+            }
+        }
+    }));
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = {
+            .light = (Light){
+                .type = LIGHT_TYPE_POINT,
+                .intensity = 0.6,
+                .position = (Vector3){2, 1, 0}
+            }
+        }
+    }));
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = {
+            .light = (Light){
+                .type = LIGHT_TYPE_DIRECTIONAL,
+                .intensity = 0.2,
+                .direction = (Vector3){1, 4, 4}
+            }
+        }
+    }));
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_SPHERE,
+        .obj = {
+            .sphere = (Sphere){
+                .radius = 5000,
+                .center = (Vector3){0, -5001, 0},
+                .color = to_c(255, 255, 0)
+            }
+        }
+    }));
+}
+
+// The demo's spheres with the shiny and reflective materials of the book's
+// reflection chapter
+void scene_mirrors(Scene *scene) {
+    struct { Vector3 center; float radius; uint32_t color; float specular; float reflective; } spheres[] = {
+        {{0, -1, 3},     1,    to_c(255, 0, 0),   500,  0.2},
+        {{-2, 0, 4},     1,    to_c(0, 255, 0),   10,   0.4},
+        {{2, 0, 4},      1,    to_c(0, 0, 255),   500,  0.3},
+        {{0, -5001, 0},  5000, to_c(255, 255, 0), 1000, 0.5},
+    };
+    for (size_t i = 0; i < sizeof(spheres)/sizeof(spheres[0]); i++) {
+        nob_da_append(scene, ((SceneObject) {
+            .type = SCENE_OBJECT_SPHERE,
+            .obj = {
+                .sphere = (Sphere){
+                    .radius = spheres[i].radius,
+                    .center = spheres[i].center,
+                    .color = spheres[i].color,
+                    .specular = spheres[i].specular,
+                    .reflective = spheres[i].reflective,
+                }
+            }
+        }));
+    }
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = { .light = (Light){ .type = LIGHT_TYPE_AMBIENT, .intensity = 0.2 } }
+    }));
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = { .light = (Light){ .type = LIGHT_TYPE_POINT, .intensity = 0.6, .position = (Vector3){2, 1, 0} } }
+    }));
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = { .light = (Light){ .type = LIGHT_TYPE_DIRECTIONAL, .intensity = 0.2, .direction = (Vector3){1, 4, 4} } }
+    }));
+}
+
+// xorshift64, so every machine builds the same random scenes
+static float scene_random_float(uint64_t *state, float lo, float hi) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return lo + (hi - lo)*(float)(*state >> 40)/(float)(1ull << 24);
+}
+
+// count small spheres in front of the default camera, lit like the demo
+void scene_random(Scene *scene, size_t count, uint64_t seed) {
+    uint64_t state = seed ? seed : 0x9E3779B97F4A7C15ull;
+    nob_da_reserve(scene, scene->count + count + 3);
+    for (size_t i = 0; i < count; i++) {
+        float radius = scene_random_float(&state, 0.05, 0.5);
+        Vector3 center = {
+            scene_random_float(&state, -20, 20),
+            scene_random_float(&state, -20, 20),
+            scene_random_float(&state, 2, 60),
+        };
+        uint32_t r = (uint32_t)scene_random_float(&state, 64, 256);
+        uint32_t g = (uint32_t)scene_random_float(&state, 64, 256);
+        uint32_t b = (uint32_t)scene_random_float(&state, 64, 256);
+        nob_da_append(scene, ((SceneObject) {
+            .type = SCENE_OBJECT_SPHERE,
+            .obj = {
+                .sphere = (Sphere){
+                    .radius = radius,
+                    .center = center,
+                    .color = to_c(r, g, b),
+                }
+            }
+        }));
+    }
+
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = { .light = (Light){ .type = LIGHT_TYPE_AMBIENT, .intensity = 0.2 } }
+    }));
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = { .light = (Light){ .type = LIGHT_TYPE_POINT, .intensity = 0.6, .position = (Vector3){2, 1, 0} } }
+    }));
+    nob_da_append(scene, ((SceneObject) {
+        .type = SCENE_OBJECT_LIGHT,
+        .obj = { .light = (Light){ .type = LIGHT_TYPE_DIRECTIONAL, .intensity = 0.2, .direction = (Vector3){1, 4, 4} } }
+    }));
+}
+
+// The demo plus count point lights on a ring above it, sharing the demo's
+// point light intensity between them
+void scene_many_lights(Scene *scene, size_t count) {
+    scene_demo(scene);
+    for (size_t i = 0; i < count; i++) {
+        float angle = 2*PI*i/count;
+        nob_da_append(scene, ((SceneObject) {
+            .type = SCENE_OBJECT_LIGHT,
+            .obj = {
+                .light = (Light){
+                    .type = LIGHT_TYPE_POINT,
+                    .intensity = 0.6/count,
+                    .position = (Vector3){4*cosf(angle), 3, 4 + 4*sinf(angle)},
+                }
+            }
+        }));
+    }
+}
+
+static bool scene_parse_count(const char *name, const char *prefix, size_t *count) {
+    size_t n = strlen(prefix);
+    if (strncmp(name, prefix, n) != 0) return false;
+    char *end = NULL;
+    unsigned long value = strtoul(name + n, &end, 10);
+    if (end == name + n) return false;
+    if (*end == 'k') {
+        value *= 1000;
+        end += 1;
+    }
+    if (*end != '\0' || value == 0 || value > 10000000) return false;
+    *count = value;
+    return true;
+}
+
+// "demo", "mirrors", "lights<N>" or "random<N>", where N may end in k for
+// thousands, or the path of a .scene file
+bool scene_by_name(Scene *scene, const char *name) {
+    size_t count = 0;
+    if (nob_sv_end_with(nob_sv_from_cstr(name), ".scene")) {
+        return scene_load_file(scene, NULL, name);
+    } else if (strcmp(name, "demo") == 0) {
+        scene_demo(scene);
+    } else if (strcmp(name, "mirrors") == 0) {
+        scene_mirrors(scene);
+    } else if (scene_parse_count(name, "lights", &count)) {
+        scene_many_lights(scene, count);
+    } else if (scene_parse_count(name, "random", &count)) {
+        scene_random(scene, count, 1);
+    } else {
+        fprintf(stderr, "ERROR: Unknown scene %s, expected demo, mirrors, lights<N>, random<N> or a .scene file\n", name);
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    const char *path;
+    const char *line_start;
+    size_t line;
+    Nob_String_View rest;   // What is left of the current line
+} SceneParser;
+
+static bool scene_parser_error(SceneParser *p, const char *at, const char *fmt, ...) NOB_PRINTF_FORMAT(3, 4);
+
+static bool scene_parser_error(SceneParser *p, const char *at, const char *fmt, ...) {
+    fprintf(stderr, "ERROR: %s:%zu:%zu: ", p->path, p->line, (size_t)(at - p->line_start) + 1);
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    return false;
+}
+
+static inline bool scene_is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Empty at the end of the line, pointing just past its last character
+static Nob_String_View scene_parser_token(SceneParser *p) {
+    size_t i = 0;
+    while (i < p->rest.count && scene_is_blank(p->rest.data[i])) i++;
+    nob_sv_chop_left(&p->rest, i);
+    size_t n = 0;
+    while (n < p->rest.count && !scene_is_blank(p->rest.data[n])) n++;
+    return nob_sv_chop_left(&p->rest, n);
+}
+
+// Decimal floats with an optional exponent. Short mantissas are scaled by an
+// exact power of ten in double, which is what makes a million spheres load in
+// a fraction of a second; anything longer goes through strtof.
+static bool scene_parse_float(Nob_String_View token, float *out) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    const char *s = token.data;
+    size_t n = token.count, i = 0;
+    bool negative = false;
+    if (i < n && (s[i] == '-' || s[i] == '+')) negative = s[i++] == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    // Digits past the 19th are only counted, which sends the number to strtof
+    for (; i < n && '0' <= s[i] && s[i] <= '9'; i++, any = true) {
+        if (digits < 19) mantissa = mantissa*10 + (s[i] - '0');
+        else exponent += 1;
+        if (mantissa > 0) digits += 1;
+    }
+    if (i < n && s[i] == '.') {
+        for (i++; i < n && '0' <= s[i] && s[i] <= '9'; i++, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa*10 + (s[i] - '0');
+                exponent -= 1;
+            }
+            if (mantissa > 0) digits += 1;
+        }
+    }
+    if (!any) return false;
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        bool negative_exponent = false;
+        if (i < n && (s[i] == '-' || s[i] == '+')) negative_exponent = s[i++] == '-';
+        if (i == n) return false;
+        int e = 0;
+        for (; i < n && '0' <= s[i] && s[i] <= '9'; i++) {
+            if (e < 10000) e = e*10 + (s[i] - '0');
+        }
+        exponent += negative_exponent ? -e : e;
+    }
+    if (i != n) return false;
+
+    if (digits <= 19 && mantissa <= (1ull << 53) && -22 <= exponent && exponent <= 22) {
+        double value = exponent < 0 ? (double)mantissa/powers[-exponent] : (double)mantissa*powers[exponent];
+        *out = negative ? -(float)value : (float)value;
+    } else {
+        char buffer[64];
+        if (n >= sizeof(buffer)) return false;
+        memcpy(buffer, s, n);
+        buffer[n] = '\0';
+        *out = strtof(buffer, NULL);
+    }
+    return isfinite(*out);
+}
+
+static bool scene_parser_float(SceneParser *p, const char *what, float *out) {
+    Nob_String_View token = scene_parser_token(p);
+    if (token.count == 0) return scene_parser_error(p, token.data, "expected %s", what);
+    if (!scene_parse_float(token, out)) {
+        return scene_parser_error(p, token.data, "expected %s, got '"SV_Fmt"'", what, SV_Arg(token));
+    }
+    return true;
+}
+
+static bool scene_parser_vector(SceneParser *p, const char *what, Vector3 *out) {
+    return scene_parser_float(p, what, &out->x) && scene_parser_float(p, what, &out->y) && scene_parser_float(p, what, &out->z);
+}
+
+static bool scene_parser_channel(SceneParser *p, uint32_t *out) {
+    Nob_String_View token = scene_parser_token(p);
+    uint32_t value = 0;
+    bool ok = token.count > 0 && token.count <= 3;
+    for (size_t i = 0; ok && i < token.count; i++) {
+        ok = '0' <= token.data[i] && token.data[i] <= '9';
+        value = value*10 + (token.data[i] - '0');
+    }
+    if (!ok || value > 255) {
+        if (token.count == 0) return scene_parser_error(p, token.data, "expected a color channel 0..255");
+        return scene_parser_error(p, token.data, "expected a color channel 0..255, got '"SV_Fmt"'", SV_Arg(token));
+    }
+    *out = value;
+    return true;
+}
+
+static bool scene_parser_positive(SceneParser *p, const char *what, float *out) {
+    size_t i = 0;
+    while (i < p->rest.count && scene_is_blank(p->rest.data[i])) i++;
+    const char *at = p->rest.data + i;
+    if (!scene_parser_float(p, what, out)) return false;
+    if (*out <= 0) return scene_parser_error(p, at, "%s must be positive", what);
+    return true;
+}
+
+static bool scene_parse_line(SceneParser *p, Scene *scene, RenderView *view) {
+    Nob_String_View directive = scene_parser_token(p);
+    if (directive.count == 0) return true;
+
+    if (nob_sv_eq(directive, nob_sv_from_cstr("sphere"))) {
+        Sphere sphere = {0};
+        uint32_t r, g, b;
+        if (!scene_parser_vector(p, "sphere center", &sphere.center)) return false;
+        if (!scene_parser_positive(p, "radius", &sphere.radius)) return false;
+        if (!scene_parser_channel(p, &r) || !scene_parser_channel(p, &g) || !scene_parser_channel(p, &b)) return false;
+        sphere.color = to_c(r, g, b);
+        Nob_String_View rest = nob_sv_trim_left(p->rest);
+        if (rest.count > 0 && !scene_parser_float(p, "specular exponent", &sphere.specular)) return false;
+        rest = nob_sv_trim_left(p->rest);
+        if (rest.count > 0 && !scene_parser_float(p, "reflectivity", &sphere.reflective)) return false;
+        nob_da_append(scene, ((SceneObject){ .type = SCENE_OBJECT_SPHERE, .obj = { .sphere = sphere } }));
+    } else if (nob_sv_eq(directive, nob_sv_from_cstr("ambient"))) {
+        Light light = { .type = LIGHT_TYPE_AMBIENT };
+        if (!scene_parser_float(p, "intensity", &light.intensity)) return false;
+        nob_da_append(scene, ((SceneObject){ .type = SCENE_OBJECT_LIGHT, .obj = { .light = light } }));
+    } else if (nob_sv_eq(directive, nob_sv_from_cstr("point"))) {
+        Light light = { .type = LIGHT_TYPE_POINT };
+        if (!scene_parser_float(p, "intensity", &light.intensity)) return false;
+        if (!scene_parser_vector(p, "light position", &light.position)) return false;
+        nob_da_append(scene, ((SceneObject){ .type = SCENE_OBJECT_LIGHT, .obj = { .light = light } }));
+    } else if (nob_sv_eq(directive, nob_sv_from_cstr("directional"))) {
+        Light light = { .type = LIGHT_TYPE_DIRECTIONAL };
+        if (!scene_parser_float(p, "intensity", &light.intensity)) return false;
+        if (!scene_parser_vector(p, "light direction", &light.direction)) return false;
+        nob_da_append(scene, ((SceneObject){ .type = SCENE_OBJECT_LIGHT, .obj = { .light = light } }));
+    } else if (nob_sv_eq(directive, nob_sv_from_cstr("camera"))) {
+        Vector3 camera;
+        if (!scene_parser_vector(p, "camera position", &camera)) return false;
+        if (view) view->camera = camera;
+    } else if (nob_sv_eq(directive, nob_sv_from_cstr("viewport"))) {
+        Vector2 v;
+        if (!scene_parser_positive(p, "viewport width", &v.x) || !scene_parser_positive(p, "viewport height", &v.y)) return false;
+        if (view) view->v = v;
+    } else if (nob_sv_eq(directive, nob_sv_from_cstr("distance"))) {
+        float distance;
+        if (!scene_parser_positive(p, "viewport distance", &distance)) return false;
+        if (view) view->distance = distance;
+    } else {
+        return scene_parser_error(p, directive.data, "unknown directive '"SV_Fmt"', expected sphere, ambient, point, directional, camera, viewport or distance", SV_Arg(directive));
+    }
+
+    Nob_String_View extra = scene_parser_token(p);
+    if (extra.count > 0) {
+        return scene_parser_error(p, extra.data, "unexpected '"SV_Fmt"' after "SV_Fmt, SV_Arg(extra), SV_Arg(directive));
+    }
+    return true;
+}
+
+// Parses in one pass over source without copying it. path only labels errors.
+bool scene_parse(Scene *scene, RenderView *view, const char *path, Nob_String_View source) {
+    // One object per line at most, so the scene grows once
+    size_t lines = 1;
+    for (const char *s = source.data, *end = source.data + source.count; (s = memchr(s, '\n', end - s)) != NULL; s++) lines++;
+    nob_da_reserve(scene, scene->count + lines);
+
+    size_t count = scene->count;
+    RenderView parsed = view ? *view : (RenderView){0};
+    SceneParser p = { .path = path };
+    while (source.count > 0) {
+        Nob_String_View line = nob_sv_chop_by_delim(&source, '\n');
+        p.line += 1;
+        p.line_start = line.data;
+        p.rest = nob_sv_chop_by_delim(&line, '#');
+        if (!scene_parse_line(&p, scene, view ? &parsed : NULL)) {
+            scene->count = count;
+            return false;
+        }
+    }
+    if (view) *view = parsed;
+    return true;
+}
+
+bool scene_load_file(Scene *scene, RenderView *view, const char *path) {
+    Nob_String_Builder source = {0};
+    if (!nob_read_entire_file(path, &source)) return false;
+    bool ok = scene_parse(scene, view, path, nob_sb_to_sv(source));
+    nob_sb_free(source);
+    return ok;
+}
+
+// Floats are written with enough digits to load back bit for bit
+bool scene_save_file(const Scene *scene, const RenderView *view, const char *path) {
+    Nob_String_Builder out = {0};
+    if (view) {
+        nob_sb_appendf(&out, "camera %.9g %.9g %.9g\n", view->camera.x, view->camera.y, view->camera.z);
+        nob_sb_appendf(&out, "viewport %.9g %.9g\n", view->v.x, view->v.y);
+        nob_sb_appendf(&out, "distance %.9g\n", view->distance);
+    }
+    for (size_t i = 0; i < scene->count; i++) {
+        const SceneObject *object = &scene->items[i];
+        if (object->type == SCENE_OBJECT_SPHERE) {
+            const Sphere *s = &object->obj.sphere;
+            nob_sb_appendf(&out, "sphere %.9g %.9g %.9g %.9g %u %u %u", s->center.x, s->center.y, s->center.z, s->radius,
+                           color_r(s->color), color_g(s->color), color_b(s->color));
+            if (s->specular != 0 || s->reflective != 0) nob_sb_appendf(&out, " %.9g", s->specular);
+            if (s->reflective != 0) nob_sb_appendf(&out, " %.9g", s->reflective);
+            nob_sb_append_cstr(&out, "\n");
+        } else {
+            const Light *l = &object->obj.light;
+            switch (l->type) {
+                case LIGHT_TYPE_AMBIENT:
+                    nob_sb_appendf(&out, "ambient %.9g\n", l->intensity);
+                    break;
+                case LIGHT_TYPE_POINT:
+                    nob_sb_appendf(&out, "point %.9g %.9g %.9g %.9g\n", l->intensity, l->position.x, l->position.y, l->position.z);
+                    break;
+                case LIGHT_TYPE_DIRECTIONAL:
+                    nob_sb_appendf(&out, "directional %.9g %.9g %.9g %.9g\n", l->intensity, l->direction.x, l->direction.y, l->direction.z);
+                    break;
+            }
+        }
+    }
+    bool ok = nob_write_entire_file(path, out.items, out.count);
+    nob_sb_free(out);
+    return ok;
+}
+
+#endif // SCENES_IMPLEMENTATION
@@ -0,0 +1,118 @@
+#define NOB_IMPLEMENTATION
+#include "nob.h"
+
+#define GRAPHICS_IMPLEMENTATION
+#include "graphics.h"
+
+#define SCENES_IMPLEMENTATION
+#include "scenes.h"
+
+#define TEST_WIDTH 320
+#define TEST_HEIGHT 240
+#define GOLDEN_DIR "tests/golden"
+
+// Renders fixed scenes and compares them with the references under
+// GOLDEN_DIR. The scalar kernel is pinned so the references do not depend on
+// the machine; the thresholds leave room for float reordering, not for
+// visible changes.
+typedef struct {
+    const char *scene;
+    int max_error;      // Largest allowed channel difference
+    double min_psnr;    // Smallest allowed PSNR in dB
+} GoldenCase;
+
+static const GoldenCase golden_cases[] = {
+    { "demo",     1, 50 },
+    { "mirrors",  1, 50 },
+    { "lights64", 1, 50 },
+    { "random1k", 1, 50 },
+};
+
+static bool golden_render(RenderPool *pool, const char *name, Canvas *canvas) {
+    Scene scene = {0};
+    if (!scene_by_name(&scene, name)) return false;
+    CompiledScene compiled = compile_scene(&scene);
+    RenderView view = { .camera = {0, 0, 0}, .v = {1, 1}, .distance = 1 };
+    SampleSettings sampling = { .samples = 1, .pattern = SAMPLE_GRID };
+    render_scene_sampled(pool, canvas, &compiled, view, sampling, NULL);
+    free_compiled_scene(&compiled);
+    nob_da_free(scene);
+    return true;
+}
+
+static bool golden_check(const GoldenCase *test, Canvas *canvas, const char *reference) {
+    Canvas expected = {0};
+    if (!canvas_from_ppm_file(&expected, reference)) {
+        fprintf(stderr, "ERROR: Missing reference %s, bless it with ./test -bless\n", reference);
+        return false;
+    }
+    if (expected.width != canvas->width || expected.height != canvas->height) {
+        fprintf(stderr, "ERROR: %s is %dx%d but the render is %dx%d\n", reference,
+                expected.width, expected.height, canvas->width, canvas->height);
+        free(expected.pixels);
+        return false;
+    }
+
+    Canvas heatmap = canvas_alloc(canvas->width, canvas->height);
+    CanvasDiff diff = canvas_diff(&expected, canvas, &heatmap);
+    bool ok = diff.max_error <= test->max_error && diff.psnr >= test->min_psnr;
+    printf("%-10s: %s, max error %d (<= %d), %zu pixels differ, PSNR %.2f dB (>= %.0f)\n",
+           test->scene, ok ? "ok" : "FAILED", diff.max_error, test->max_error, diff.differing, diff.psnr, test->min_psnr);
+    if (!ok) {
+        const char *path = nob_temp_sprintf("%s.diff.ppm", test->scene);
+        if (canvas_to_ppm_file(&heatmap, path)) printf("%-10s: wrote heatmap to %s\n", test->scene, path);
+    }
+
+    canvas_free(&heatmap);
+    free(expected.pixels);
+    return ok;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-bless]\n", program);
+    fprintf(stderr, "Compares renders of the test scenes with %s/<scene>.ppm.\n", GOLDEN_DIR);
+    fprintf(stderr, "    -bless    overwrite the references with the current renders\n");
+}
+
+int main(int argc, char **argv) {
+    const char *program = nob_shift_args(&argc, &argv);
+    bool bless = false;
+    while (argc > 0) {
+        const char *arg = nob_shift_args(&argc, &argv);
+        if (strcmp(arg, "-bless") == 0) {
+            bless = true;
+        } else {
+            usage(program);
+            return 1;
+        }
+    }
+
+    sphere_kernel_select(SPHERE_KERNEL_SCALAR);
+    RenderPool *pool = render_pool_create(0, RENDER_TILE_SIZE);
+    if (pool == NULL) return 1;
+    Canvas canvas = canvas_alloc(TEST_WIDTH, TEST_HEIGHT);
+
+    size_t failed = 0;
+    if (bless && !(nob_mkdir_if_not_exists("tests") && nob_mkdir_if_not_exists(GOLDEN_DIR))) return 1;
+    for (size_t i = 0; i < NOB_ARRAY_LEN(golden_cases); i++) {
+        const GoldenCase *test = &golden_cases[i];
+        const char *reference = nob_temp_sprintf("%s/%s.ppm", GOLDEN_DIR, test->scene);
+        bool ok = golden_render(pool, test->scene, &canvas);
+        if (ok && bless) {
+            ok = canvas_to_ppm_file(&canvas, reference);
+            if (ok) printf("%-10s: blessed %s\n", test->scene, reference);
+        } else if (ok) {
+            ok = golden_check(test, &canvas, reference);
+        }
+        failed += !ok;
+        nob_temp_reset();
+    }
+
+    canvas_free(&canvas);
+    render_pool_destroy(pool);
+    if (failed > 0) {
+        fprintf(stderr, "ERROR: %zu of %zu golden tests failed\n", failed, NOB_ARRAY_LEN(golden_cases));
+        return 1;
+    }
+    return 0;
+}